@@ -0,0 +1,72 @@
+-- Lua side frame cost of a converted cartridge. The TIC-80 API is stubbed out, so this measures what the cart and
+-- the helper lib do per frame (wrapper calls, table allocations), but not the drawing itself. Needs Lua 5.3:
+--
+--   ./p8totic ../bench/spr.p8 spr.tic && lua5.3 ../bench/frame.lua spr.tic [frames]
+--
+-- To see how an older helper lib did, convert the same cart with that version of p8totic.
+
+local fn, frames = arg[1], tonumber(arg[2] or 1000)
+if not fn then print("usage: lua5.3 frame.lua <tic> [frames]") os.exit(1) end
+local f = assert(io.open(fn, "rb"))
+local tic = f:read("a")
+f:close()
+
+-- each chunk has a 4 bytes header: type and bank, 16 bit size, reserved. The Lua code is in CHUNK_CODE (5), and the
+-- tiles, sprites, map and sprite flags are loaded into RAM, because the helper lib reads those with peek and mget
+local code, ram, addr, i = {}, {}, { [1] = 0x4000, [2] = 0x6000, [4] = 0x8000, [6] = 0x14404 }, 1
+while i + 3 <= #tic do
+  local t, s = tic:byte(i), string.unpack("<I2", tic, i + 1)
+  if t & 31 == 5 then code[#code + 1] = tic:sub(i + 4, i + 3 + s) end
+  if t < 32 and addr[t] then for j = 0, s - 1 do ram[addr[t] + j] = tic:byte(i + 4 + j) end end
+  i = i + 4 + s
+end
+code = table.concat(code):gsub("%z+$", "")
+if #code == 0 then print(fn .. ": no code chunk") os.exit(1) end
+
+-- the TIC-80 API, counting the calls. Only memory access does something, everything else is a no-op. Like on TIC-80,
+-- nil arguments are taken as 0
+local env, calls = setmetatable({}, { __index = _G }), {}
+local function stub(name, fn)
+  return function(...) calls[name] = (calls[name] or 0) + 1 if fn then return fn(...) end return 0 end
+end
+for _, name in ipairs({ "circ", "circb", "clip", "cls", "elli", "ellib", "exit", "font", "fset", "line", "map",
+    "memcpy", "memset", "music", "pix", "pmem", "poke1", "poke2", "print", "rect", "rectb", "reset", "sfx", "spr",
+    "sync", "trace", "tri", "trib", "textri", "ttri", "tstamp", "vbank", "peek1", "peek2" }) do
+  env[name] = stub(name)
+end
+for _, name in ipairs({ "btn", "btnp", "fget", "key", "keyp" }) do env[name] = stub(name, function() return false end) end
+env.peek = stub("peek", function(a) return ram[a // 1] or 0 end)
+env.poke = stub("poke", function(a, v) ram[a // 1] = (v or 0) // 1 & 255 end)
+env.peek4 = stub("peek4", function(a) a = a // 1 return (ram[a // 2] or 0) >> (a % 2 * 4) & 15 end)
+env.poke4 = stub("poke4", function(a, v)
+  a, v = a // 1, (v or 0) // 1 & 15
+  local b = ram[a // 2] or 0
+  ram[a // 2] = a % 2 == 0 and (b & 0xf0) | v or (b & 15) | v << 4
+end)
+env.mget = stub("mget", function(x, y) return ram[0x8000 + (y // 1) * 240 + x // 1] or 0 end)
+env.mset = stub("mset", function(x, y, v) ram[0x8000 + (y // 1) * 240 + x // 1] = (v or 0) // 1 & 255 end)
+env.mouse = function() return 0, 0, false, false, false, 0, 0 end
+env.time = function() return os.clock() * 1000 end
+
+assert(load(code, "=" .. fn, "t", env))()
+if env.BOOT then env.BOOT() end
+-- warm up, then time the frames
+for n = 1, 10 do env.TIC() end
+collectgarbage()
+local t = os.clock()
+for n = 1, frames do env.TIC() end
+t = os.clock() - t
+-- allocations per frame, with the collector stopped so that nothing is freed in between
+calls = {}
+collectgarbage()
+collectgarbage("stop")
+local kb = collectgarbage("count")
+for n = 1, 100 do env.TIC() end
+kb = (collectgarbage("count") - kb) / 100
+collectgarbage("restart")
+
+print(string.format("%s: %.1f us per frame, %.1f KB allocated per frame", fn, t * 1000000 / frames, kb))
+local names = {}
+for name in pairs(calls) do names[#names + 1] = name end
+table.sort(names)
+for _, name in ipairs(names) do print(string.format("  %-8s %6d calls per frame", name, calls[name] // 100)) end
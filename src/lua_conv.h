@@ -83,148 +83,747 @@ char *lua_typ[] = { "false", "local", "nil", "true", NULL };
 char *lua_kws[] = { "and", "break", "do", "else", "elseif", "end", "for", "function", "if", "in", "not", "or",
     "repeat", "return", "then", "until", "while", NULL };
 char **lua_rules[] = { lua_com, NULL, lua_ops, lua_num, lua_str, lua_sep, lua_typ, lua_kws };
+static tok_rules_t *lua_compiled = NULL;
 
 /**
- * Lua syntax converter
+ * Returns the precompiled Lua rules, compiles them on first call (thread safe, the loser of a race frees its copy)
+ */
+static tok_rules_t *lua_getrules(void)
+{
+    tok_rules_t *r = __atomic_load_n(&lua_compiled, __ATOMIC_ACQUIRE), *expected = NULL;
+
+    if(!r && (r = tok_compile(lua_rules)) &&
+      !__atomic_compare_exchange_n(&lua_compiled, &expected, r, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        tok_rules_free(r);
+        r = expected;
+    }
+    return r;
+}
+
+/* API rewrite kinds */
+enum {
+    API_RENAME,     /* replace the token with str, as newtype */
+    API_DROPCALL,   /* remove the whole call, "cartdata(x)" -> "" */
+    API_INFIX,      /* function to floored operator str, "band(a,b)" -> "(a//1&b//1)" */
+    API_PREFIX,     /* function to floored unary operator str, "bnot(a)" -> "~(a//1)" */
+    API_ARGTRIM,    /* keep the first argument only, "music(a,b,c)" -> "music(a)" */
+    API_RANDOM,     /* rename to str if the call is multiplied, otherwise to alt, "rnd(x)" -> "math.random()*(x)" */
+    API_MEMOP       /* map PICO-8 memory addresses to TIC-80 RAM, "poke(0x6000+x,c)" -> "poke((x)//64*120+(x)%64,c)" */
+};
+typedef struct {
+    char type;      /* token type to match, TOK_FUNCTION or TOK_VARIABLE */
+    char kind;      /* one of API_* enums */
+    char *name;     /* PICO-8 name */
+    char newtype;   /* token type of the replacement */
+    char *str, *alt;/* replacement */
+} lua_api_t;
+
+/* FIXME: if there's any more API difference between PICO-8 and TIC-80, add it here. These are applied in order, so
+ * a token can be rewritten by more entries, but only by ones listed after the previous rewrite.
+ * Also, if you add a Lua API change, remove the relevant part from the helper lib below! */
+lua_api_t lua_api[] = {
+    { TOK_FUNCTION, API_RENAME,   "dget",     TOK_FUNCTION, "pmem", NULL },
+    { TOK_FUNCTION, API_RENAME,   "dset",     TOK_FUNCTION, "pmem", NULL },
+    { TOK_FUNCTION, API_DROPCALL, "cartdata", 0, NULL, NULL },
+    /* bit operations, the helper lib still has these for indirect uses, like passing band as a value */
+    { TOK_FUNCTION, API_INFIX,    "band",     TOK_OPERATOR, "&", NULL },
+    { TOK_FUNCTION, API_INFIX,    "bor",      TOK_OPERATOR, "|", NULL },
+    { TOK_FUNCTION, API_INFIX,    "bxor",     TOK_OPERATOR, "~", NULL },
+    { TOK_FUNCTION, API_PREFIX,   "bnot",     TOK_OPERATOR, "~", NULL },
+    { TOK_FUNCTION, API_INFIX,    "shl",      TOK_OPERATOR, "<<", NULL },
+    { TOK_FUNCTION, API_INFIX,    "shr",      TOK_OPERATOR, ">>", NULL },
+    /* the other arguments not supported on TIC-80 */
+    { TOK_FUNCTION, API_ARGTRIM,  "music",    0, NULL, NULL },
+    { TOK_FUNCTION, API_RENAME,   "mapdraw",  TOK_FUNCTION, "map", NULL },
+    /* misc functions */
+    { TOK_FUNCTION, API_RENAME,   "tostr",    TOK_FUNCTION, "tostring", NULL },
+    /* memory access, peek2 / peek4 and poke2 / poke4 are tokenized as "peek" and "poke" followed by a number */
+    { TOK_FUNCTION, API_MEMOP,    "peek",     0, NULL, NULL },
+    { TOK_FUNCTION, API_MEMOP,    "poke",     0, NULL, NULL },
+    { TOK_FUNCTION, API_MEMOP,    "memcpy",   0, NULL, NULL },
+    { TOK_FUNCTION, API_MEMOP,    "memset",   0, NULL, NULL },
+    /* math functions */
+    { TOK_FUNCTION, API_RENAME,   "srand",    TOK_FUNCTION, "math.randomseed", NULL },
+    { TOK_FUNCTION, API_RENAME,   "sqrt",     TOK_FUNCTION, "math.sqrt", NULL },
+    { TOK_FUNCTION, API_RENAME,   "abs",      TOK_FUNCTION, "math.abs", NULL },
+    { TOK_FUNCTION, API_RENAME,   "min",      TOK_FUNCTION, "math.min", NULL },
+    { TOK_FUNCTION, API_RENAME,   "max",      TOK_FUNCTION, "math.max", NULL },
+    { TOK_FUNCTION, API_RENAME,   "flr",      TOK_FUNCTION, "math.floor", NULL },
+    { TOK_FUNCTION, API_RANDOM,   "rnd",      TOK_FUNCTION, "math.random", "math.random()*" },
+    { TOK_VARIABLE, API_RENAME,   "pi",       TOK_VARIABLE, "math.pi", NULL },
+    /* some functions (like btn) accepts special characters as if they were constant variables */
+    { TOK_VARIABLE, API_RENAME,   "⬇",        TOK_NUMBER, "1", NULL },    /* Down */
+    { TOK_VARIABLE, API_RENAME,   "⬅",        TOK_NUMBER, "2", NULL },    /* Left */
+    { TOK_VARIABLE, API_RENAME,   "➡",        TOK_NUMBER, "3", NULL },    /* Right */
+    { TOK_VARIABLE, API_RENAME,   "⬆",        TOK_NUMBER, "0", NULL },    /* Up */
+    { TOK_VARIABLE, API_RENAME,   "🅾",        TOK_NUMBER, "4", NULL },    /* O */
+    { TOK_VARIABLE, API_RENAME,   "❎",        TOK_NUMBER, "6", NULL }     /* X */
+};
+#define LUA_APIHASH 64
+static int *lua_apihash = NULL;
+
+/**
+ * Hash of a token string (FNV-1a), including its type. If l is -1, then up to the terminating zero
+ */
+static unsigned int lua_hash(char *s, int l)
+{
+    unsigned int h = 2166136261U;
+
+    for(; l && *s; s++, l--)
+        h = (h ^ (unsigned char)*s) * 16777619U;
+    return h;
+}
+
+/**
+ * Look up a token in the API rewrite table, returns the index or -1. The hash table is built on first call (thread
+ * safe, the same way as lua_getrules())
+ */
+static int lua_apifind(char *t)
+{
+    int *h = __atomic_load_n(&lua_apihash, __ATOMIC_ACQUIRE), *expected = NULL, i, j;
+    char tmp[64];
+
+    if(!h) {
+        if(!(h = (int*)malloc(LUA_APIHASH * sizeof(int)))) return -1;
+        memset(h, 0xff, LUA_APIHASH * sizeof(int));
+        for(i = 0; i < (int)(sizeof(lua_api) / sizeof(lua_api[0])); i++) {
+            tmp[0] = lua_api[i].type;
+            strcpy(tmp + 1, lua_api[i].name);
+            for(j = lua_hash(tmp, -1) & (LUA_APIHASH - 1); h[j] != -1; j = (j + 1) & (LUA_APIHASH - 1));
+            h[j] = i;
+        }
+        if(!__atomic_compare_exchange_n(&lua_apihash, &expected, h, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(h);
+            h = expected;
+        }
+    }
+    if(!t || (t[0] != TOK_FUNCTION && t[0] != TOK_VARIABLE)) return -1;
+    for(j = lua_hash(t, -1) & (LUA_APIHASH - 1); (i = h[j]) != -1; j = (j + 1) & (LUA_APIHASH - 1))
+        if(t[0] == lua_api[i].type && !strcmp(t + 1, lua_api[i].name)) return i;
+    return -1;
+}
+
+#define lua_isspace(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+#define lua_isword(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || ((c) >= '0' && (c) <= '9') || \
+    (c) == '_' || (unsigned char)(c) >= 0x80)
+
+#define LUA_CALLMAX 4
+/* a call's arguments in the token list, and the tokens it's going to be replaced with */
+typedef struct {
+    int st[LUA_CALLMAX + 2], so[LUA_CALLMAX + 2];   /* token index and offset of the "(", the commas and the ")" */
+    int num, nb, nins, maxins;                      /* number of arguments, boundaries and replacement tokens */
+    char *buf, *d, *end, **ins;
+} lua_call_t;
+
+static void lua_callfree(lua_call_t *call)
+{
+    if(call->buf) { free(call->buf); call->buf = NULL; }
+    if(call->ins) { free(call->ins); call->ins = NULL; }
+}
+
+/**
+ * Add a replacement token. On overflow the call is marked as invalid, so that it's left as-is
+ */
+static void lua_callput(lua_call_t *call, char type, char *s, int len)
+{
+    if(call->nins >= call->maxins || call->d + len + 2 > call->end) { call->num = -1; return; }
+    call->ins[call->nins++] = call->d; *call->d++ = type; memcpy(call->d, s, len); call->d += len; *call->d++ = 0;
+}
+
+/**
+ * Remove the replacement tokens added since the kth
+ */
+static void lua_calldrop(lua_call_t *call, int k)
+{
+    if(k < call->nins) { call->d = call->ins[k]; call->nins = k; }
+}
+
+/**
+ * Add the pieces of the nth argument as replacement tokens, dropping the whitespace only ones (except for the newline
+ * that ends a comment) and the first skip pieces. Returns the number of tokens added
+ */
+static int lua_callarg(tok_t *tok, lua_call_t *call, int n, int skip)
+{
+    int i, j, b, l, k = call->nins;
+    char *t;
+
+    for(i = call->st[n]; i <= call->st[n + 1]; i++) {
+        t = tok_get(tok, i);
+        b = i == call->st[n] ? call->so[n] + 1 : 1;
+        l = i == call->st[n + 1] ? call->so[n + 1] : 1 + (int)strlen(t + 1);
+        for(j = b; j < l && lua_isspace(t[j]); j++);
+        if(j >= l) {
+            if(call->nins > k && call->ins[call->nins - 1][0] == TOK_COMMENT) lua_callput(call, TOK_SEPARATOR, "\n", 1);
+            continue;
+        }
+        if(skip) skip--;
+        else lua_callput(call, t[0], t + b, l - b);
+    }
+    return call->nins - k;
+}
+
+/**
+ * Returns 1 if the nth argument is a single variable or number, so that it can be repeated
+ */
+static int lua_callsimple(tok_t *tok, lua_call_t *call, int n)
+{
+    int k = call->nins, r = lua_callarg(tok, call, n, 0) == 1 &&
+        (call->ins[k][0] == TOK_VARIABLE || call->ins[k][0] == TOK_NUMBER);
+
+    lua_calldrop(call, k);
+    return r;
+}
+
+/**
+ * Locate the arguments of a call, the function's name is in the tokens from idx up to the opening bracket at idx + n.
+ * Arguments are split by characters, because the separator tokens might hold more than one bracket or comma. Returns
+ * the number of arguments, or -1 if it's not a call, the cart defines its own function with this name, or it has more
+ * than LUA_CALLMAX arguments
+ */
+static int lua_callfind(tok_t *tok, int idx, int n, lua_call_t *call)
+{
+    int i, j, l = 0, p = 0;
+    char *t;
+
+    memset(call, 0, sizeof(lua_call_t));
+    call->num = -1;
+    if(idx + n >= tok->num || tok_get(tok, idx + n)[0] != TOK_SEPARATOR || tok_get(tok, idx + n)[1] != '(') return -1;
+    for(i = idx - 1; i >= 0 && tok_get(tok, i)[0] == TOK_SEPARATOR && lua_isspace(tok_get(tok, i)[1]); i--);
+    if(i >= 0 && tok_get(tok, i)[0] == TOK_KEYWORD && !strcmp(tok_get(tok, i) + 1, "function")) return -1;
+    /* locate the opening bracket, the commas and the closing bracket */
+    for(i = idx + n, n = 0; i < tok->num && n <= LUA_CALLMAX + 1; i++) {
+        t = tok_get(tok, i); l += strlen(t + 1) + 5;
+        if(t[0] == TOK_STRING || t[0] == TOK_COMMENT) continue;
+        for(j = 1; t[j] && n <= LUA_CALLMAX + 1; j++) {
+            if(t[j] == '(' || t[j] == '{' || t[j] == '[') {
+                if(!p++) { call->st[n] = i; call->so[n++] = j; }
+            } else
+            if(t[j] == ')' || t[j] == '}' || t[j] == ']') {
+                if(!--p) { call->st[n] = i; call->so[n++] = j; break; }
+            } else
+            if(t[j] == ',' && p == 1) { call->st[n] = i; call->so[n++] = j; }
+        }
+        if(!p) break;
+    }
+    if(p || n < 2 || tok_get(tok, call->st[n - 1])[call->so[n - 1]] != ')') return -1;
+    /* the arguments might be repeated a few times in the replacement */
+    call->nb = n;
+    call->maxins = 8 * (call->st[n - 1] - idx) + 64;
+    if(!(call->buf = (char*)malloc(8 * l + 1024)) || !(call->ins = (char**)malloc(call->maxins * sizeof(char*)))) {
+        lua_callfree(call);
+        return -1;
+    }
+    call->d = call->buf; call->end = call->buf + 8 * l + 1024;
+    call->num = n - 1;
+    /* "f()" has no arguments */
+    if(n == 2 && !lua_callarg(tok, call, 0, 0)) call->num = 0;
+    lua_calldrop(call, 0);
+    return call->num;
+}
+
+/**
+ * Replace the call (from idx up to its closing bracket) with the replacement tokens, keeping whatever was after the
+ * closing bracket in the same token. Frees the call, returns 1 on success, 0 if the call was left as-is
+ */
+static int lua_callsplice(tok_t *tok, int idx, lua_call_t *call)
+{
+    int e, o, r = 0;
+    char *t;
+
+    if(call->num >= 0 && call->nins > 0) {
+        e = call->st[call->nb - 1]; o = call->so[call->nb - 1];
+        t = tok_get(tok, e);
+        if(t[o + 1]) lua_callput(call, t[0], t + o + 1, strlen(t + o + 1));
+        if(call->num >= 0) r = tok_splice(tok, idx, e - idx + 1, call->ins, call->nins);
+    }
+    lua_callfree(call);
+    return r;
+}
+
+/**
+ * Returns how many replacement tokens lua_callarg() would add for the nth argument without copying them, but only up to
+ * max, so that long arguments aren't walked through
+ */
+static int lua_callcount(tok_t *tok, lua_call_t *call, int n, int max)
+{
+    int i, j, b, l, m = 0, c = 0;
+    char *t;
+
+    for(i = call->st[n]; i <= call->st[n + 1] && m < max; i++) {
+        t = tok_get(tok, i);
+        b = i == call->st[n] ? call->so[n] + 1 : 1;
+        l = i == call->st[n + 1] ? call->so[n + 1] : 1 + (int)strlen(t + 1);
+        for(j = b; j < l && lua_isspace(t[j]); j++);
+        if(j < l) { m++; c = t[0] == TOK_COMMENT; } else
+        if(c) { m++; c = 0; }
+    }
+    return m;
+}
+
+/**
+ * Add a piece of a token as a replacement token the same way as lua_callarg() does, c tells if the last one added
+ * for this argument was a comment
+ */
+static void lua_callpiece(lua_call_t *call, char *t, int b, int l, int *c)
+{
+    int j;
+
+    for(j = b; j < l && lua_isspace(t[j]); j++);
+    if(j < l) { lua_callput(call, t[0], t + b, l - b); *c = t[0] == TOK_COMMENT; } else
+    if(*c) { lua_callput(call, TOK_SEPARATOR, "\n", 1); *c = 0; }
+}
+
+/**
+ * Rewrite a bit operation call at token idx into Lua 5.3 operators. The PICO-8 functions work on the integer part, so
+ * the arguments are floored with "//1" (which is a single opcode, unlike a math.floor() call), except for integer
+ * literals: "band(a,b)" -> "(a//1&b//1)", "bnot(a)" -> "~(a//1)". Returns 1 on success, 0 if the call was left as-is.
+ * Unlike the other rewrites, this one is done in place: only the tokens with the brackets and commas of the call are
+ * replaced and the whitespace only ones are removed, the rest of the arguments stay where they are, otherwise nested
+ * calls like "shl(shl(shl(a,1),1),1)" would be copied over and over again, once for every level
+ */
+static int lua_bitop(tok_t *tok, int idx, char *op, int nargs)
+{
+    lua_call_t call;
+    int n, i, j, b, k, m, c = 0, ne = 0, w[LUA_CALLMAX], *ed;
+    char *t;
+
+    if(lua_callfind(tok, idx, 1, &call) != nargs) { lua_callfree(&call); return 0; }
+    /* how the arguments are floored, 0 integer literals not at all, 1 single variables and numbers with "//1", 2 anything
+     * else needs brackets around too */
+    for(n = 0; n < nargs; n++) {
+        if(!(m = lua_callcount(tok, &call, n, 2))) { lua_callfree(&call); return 0; }
+        w[n] = 2;
+        if(m == 1) {
+            k = call.nins;
+            lua_callarg(tok, &call, n, 0);
+            t = call.ins[k];
+            if(t[0] == TOK_VARIABLE || t[0] == TOK_NUMBER) {
+                for(j = t[0] == TOK_NUMBER ? (t[1] == '0' && (t[2] == 'x' || t[2] == 'X') ? 3 : 1) : 0; j && t[j] && t[j] != '.'; j++);
+                w[n] = !j || t[j];
+            }
+            lua_calldrop(&call, k);
+        }
+    }
+    /* collect the edits first (token range and replacement tokens), so that nothing is modified if the call overflows */
+    if(!(ed = (int*)malloc(4 * (call.st[call.nb - 1] - idx + 1) * sizeof(int)))) { lua_callfree(&call); return 0; }
+    for(i = idx + 1, n = 0; i <= call.st[call.nb - 1]; i++) {
+        t = tok_get(tok, i);
+        k = call.nins;
+        if(i != call.st[n]) {
+            /* inside an argument, keep it unless it's whitespace only */
+            for(j = 1; t[j] && lua_isspace(t[j]); j++);
+            if(t[j]) { c = t[0] == TOK_COMMENT; continue; }
+            if(c) { lua_callput(&call, TOK_SEPARATOR, "\n", 1); c = 0; }
+        } else {
+            /* a token with brackets or commas of this call, might have pieces of the arguments too */
+            for(b = 1; n < call.nb && call.st[n] == i; b = call.so[n++] + 1) {
+                if(n) {
+                    lua_callpiece(&call, t, b, call.so[n], &c);
+                    if(w[n - 1] == 2) lua_callput(&call, TOK_SEPARATOR, ")", 1);
+                    if(w[n - 1]) lua_callput(&call, TOK_OPERATOR, "//1", 3);
+                    if(nargs == 2 && n == 1) lua_callput(&call, TOK_OPERATOR, op, strlen(op));
+                } else {
+                    if(nargs == 1) lua_callput(&call, TOK_OPERATOR, op, strlen(op));
+                    lua_callput(&call, TOK_SEPARATOR, "(", 1);
+                }
+                if(n < call.nb - 1) {
+                    if(w[n] == 2) lua_callput(&call, TOK_SEPARATOR, "(", 1);
+                    c = 0;
+                } else
+                    lua_callput(&call, TOK_SEPARATOR, ")", 1);
+            }
+            /* the rest of the token belongs to the next argument, or it's after the call */
+            if(n < call.nb) lua_callpiece(&call, t, b, 1 + (int)strlen(t + 1), &c); else
+            if(t[b]) lua_callput(&call, t[0], t + b, strlen(t + b));
+        }
+        ed[ne * 4] = ne ? i : idx; ed[ne * 4 + 1] = i; ed[ne * 4 + 2] = k; ed[ne * 4 + 3] = call.nins; ne++;
+    }
+    /* apply them backwards, so that the token indices stay valid */
+    if(call.num >= 0)
+        while(ne-- > 0)
+            tok_splice(tok, ed[ne * 4], ed[ne * 4 + 1] - ed[ne * 4] + 1, call.ins + ed[ne * 4 + 2], ed[ne * 4 + 3] - ed[ne * 4 + 2]);
+    free(ed);
+    lua_callfree(&call);
+    return ne < 0;
+}
+
+/**
+ * Map a PICO-8 memory address to TIC-80 RAM, the same way as the __p8_addr helper lib function does, and return how
+ * many bytes (at most l) are contiguous there in run. Returns -1 if the address isn't in a region that's stored
+ * differently on TIC-80 (those are left as-is). The sprite sheet is stored as 8 x 8 sprites, the map is 240 bytes
+ * wide and the screen is 120 bytes wide, the sprite flags and the general use memory are linear. With stripe set,
+ * whole 8 pixel high stripes of the sprite sheet are returned as one run, but the bytes are in a different order
+ * there, so that's only good for memset, or for a memcpy within the sprite sheet with both sides stripe aligned
+ */
+static int lua_memaddr(int a, int l, int stripe, int *run)
+{
+    int x = a % 64, y = a / 64, m;
+
+    if(a >= 0 && a < 0x2000) {
+        /* 8 pixel high stripes of the sprite sheet are stored as 16 consecutive sprites */
+        if(stripe && !x && !(y & 7) && l >= 512) { *run = l - l % 512 < 0x2000 - a ? l - l % 512 : 0x2000 - a; return 0x4000 + a; }
+        m = 4 - x % 4; a = 0x4000 + (y / 8 * 16 + x / 4) * 32 + y % 8 * 4 + x % 4;
+    } else
+    if(a >= 0x2000 && a < 0x3000) { a -= 0x2000; m = 128 - a % 128; a = 0x8000 + a / 128 * 240 + a % 128; } else
+    if(a >= 0x3000 && a < 0x3100) { m = 0x3100 - a; a += 0x14404 - 0x3000; } else
+    if(a >= 0x4300 && a < 0x5e00) { m = 0x5e00 - a; a += 0x14e24 - 0x4300; } else
+    if(a >= 0x6000 && a < 0x8000) { a -= 0x6000; m = 64 - a % 64; a = a / 64 * 120 + a % 64; }
+    else { *run = l; return -1; }
+    *run = l < m ? l : m;
+    return a;
+}
+
+/**
+ * Split a memset (cpy = 0) or memcpy (cpy = 1) range into contiguous TIC-80 runs. Returns the number of runs if they
+ * are all the same size with a constant stride (run[] holds dst, src, their strides and the size), -1 otherwise
+ */
+static int lua_memruns(int d, int s, int len, int cpy, int *run)
+{
+    int i, x, y = 0, m, st;
+
+    for(i = 0; len > 0; i++, d += m, s += m, len -= m) {
+        st = !cpy || (d >= 0 && d < 0x2000 && s >= 0 && s < 0x2000 && !(d % 512) && !(s % 512));
+        if((x = lua_memaddr(d, len, st, &m)) < 0 || (cpy && (y = lua_memaddr(s, m, st, &m)) < 0)) return -1;
+        if(!i) { run[0] = x; run[1] = y; run[4] = m; } else
+        if(i == 1) { run[2] = x - run[0]; run[3] = y - run[1]; }
+        if(m != run[4] || (i && (x != run[0] + i * run[2] || y != run[1] + i * run[3]))) return -1;
+    }
+    return i;
+}
+
+/**
+ * Check an address argument. Returns 1 if it's an integer constant, 2 if it's a constant base plus an expression that
+ * can be repeated (no calls, and no operators with lower precedence than "+"), 0 otherwise. The constant goes to val.
+ * Calls are detected by characters, because a variable before "," and "(" is tokenized as a function
+ */
+static int lua_memarg(tok_t *tok, lua_call_t *call, int n, int *val)
+{
+    int i, k = call->nins, m = lua_callarg(tok, call, n, 0), r = 0;
+    char *t, *e, pc = '+';
+
+    if(m > 0 && call->ins[k][0] == TOK_NUMBER) {
+        *val = (int)strtol(call->ins[k] + 1, &e, 0);
+        r = !*e;
+    }
+    if(r && m > 1) {
+        r = m > 2 && call->ins[k + 1][0] == TOK_OPERATOR && !strcmp(call->ins[k + 1] + 1, "+") ? 2 : 0;
+        for(i = k + 2; r && i < k + m; i++) {
+            t = call->ins[i];
+            switch(t[0]) {
+                case TOK_VARIABLE: case TOK_FUNCTION: case TOK_NUMBER: break;
+                case TOK_OPERATOR: if(!strchr("+-*/%^", t[1]) || (t[2] && strcmp(t + 1, "//"))) r = 0; break;
+                case TOK_SEPARATOR: if(t[1 + strspn(t + 1, " \t\r\n()[]")]) r = 0; break;
+                default: r = 0; break;
+            }
+            for(e = t + 1; r && *e; e++)
+                if(!lua_isspace(*e)) {
+                    if(*e == '(' && (lua_isword(pc) || pc == ')' || pc == ']')) r = 0;
+                    pc = *e;
+                }
+        }
+    }
+    lua_calldrop(call, k);
+    return r;
+}
+
+/**
+ * Add the TIC-80 address of the nth argument, which is a constant base a (mapped to x) plus an expression. Where the
+ * layout differs, the offset is repeated in the calculation instead of calling the helper lib
+ */
+static void lua_memexpr(tok_t *tok, lua_call_t *call, int n, int a, int x)
+{
+    char *fmt, tmp[16];
+    int l;
+
+    if(a < 0x2000) { fmt = "(0x4000+@//512*512+@%64//4*32+@//64%8*4+@%4)"; } else
+    if(a < 0x3000) { fmt = "(0x8000+@//128*240+@%128)"; a -= 0x2000; } else
+    if(a >= 0x6000) { fmt = "(@//64*120+@%64)"; a -= 0x6000; } else {
+        lua_callput(call, TOK_NUMBER, tmp, sprintf(tmp, "0x%x", x));
+        lua_callput(call, TOK_OPERATOR, "+", 1);
+        lua_callarg(tok, call, n, 2);
+        return;
+    }
+    for(; *fmt; fmt += l + (fmt[l] == '@')) {
+        if((l = strcspn(fmt, "@"))) lua_callput(call, TOK_OPERATOR, fmt, l);
+        if(fmt[l] == '@') {
+            lua_callput(call, TOK_SEPARATOR, "(", 1);
+            if(a) {
+                lua_callput(call, TOK_NUMBER, tmp, sprintf(tmp, "%d", a));
+                lua_callput(call, TOK_OPERATOR, "+", 1);
+            }
+            lua_callarg(tok, call, n, 2);
+            lua_callput(call, TOK_SEPARATOR, ")", 1);
+        }
+    }
+}
+
+/**
+ * Rewrite a memory access call at token idx (peek, poke, peek2, poke2, peek4, poke4, memcpy, memset). Constant and
+ * constant base addresses are mapped to TIC-80 RAM here, anything else goes through the helper lib. Native TIC-80
+ * calls are added as variables, so that they aren't rewritten again. Returns 1 on success, 0 if left as-is
+ */
+static int lua_memop(tok_t *tok, int idx)
+{
+    lua_call_t call;
+    char *t = tok_get(tok, idx) + 1, *s, *helper = NULL, tmp[32];
+    int set = !strcmp(t, "memset"), cpy = !strcmp(t, "memcpy"), poke = !strcmp(t, "poke");
+    int w = 1, n, k, kb = 0, a = 0, b = 0, len = 0, x, y = -1, m, run[5];
+
+#define lua_memput(y, s) lua_callput(&call, (y), (s), strlen(s))
+#define lua_memnum(f, v) lua_callput(&call, TOK_NUMBER, tmp, sprintf(tmp, (f), (v)))
+    if(!set && !cpy && idx + 1 < tok->num) {
+        s = tok_get(tok, idx + 1);
+        if(s[0] == TOK_NUMBER && (!strcmp(s + 1, "2") || !strcmp(s + 1, "4"))) w = s[1] - '0';
+    }
+    if((n = lua_callfind(tok, idx, w > 1 ? 2 : 1, &call)) < 1) goto keep;
+    k = lua_memarg(tok, &call, 0, &a);
+    x = k ? lua_memaddr(a, 1, 0, &m) : -1;
+    if(set || cpy) {
+        if(n != 3) goto keep;
+        if(cpy && (kb = lua_memarg(tok, &call, 1, &b))) y = lua_memaddr(b, 1, 0, &m);
+        /* none of the addresses are in a region that TIC-80 stores differently, like the draw state */
+        if(k && x < 0 && (!cpy || (kb && y < 0))) goto keep;
+        /* overlapping ranges (like scrolling) are fine if the runs don't overlap, copied backwards if dst is after src */
+        if(k == 1 && (!cpy || kb == 1) && lua_memarg(tok, &call, 2, &len) == 1 && len > 0 &&
+          (cpy || lua_callsimple(tok, &call, 1)) && (n = lua_memruns(a, b, len, cpy, run)) > 0 &&
+          (!cpy || a + len <= b || b + len <= a || (a > b ? a - b : b - a) >= run[4])) {
+            /* "memset(0x6000,0,0x2000)" -> "for __p8_i=0,127 do memset(__p8_i*120,0,64) end" */
+            if(n > 1) {
+                lua_memput(TOK_KEYWORD, "for ");
+                lua_memput(TOK_VARIABLE, "__p8_i");
+                lua_memput(TOK_OPERATOR, "=");
+                if(cpy && a > b && a < b + len) {
+                    lua_memnum("%d", n - 1);
+                    lua_memput(TOK_SEPARATOR, ",");
+                    lua_memput(TOK_NUMBER, "0");
+                    lua_memput(TOK_SEPARATOR, ",");
+                    lua_memput(TOK_NUMBER, "-1");
+                } else {
+                    lua_memput(TOK_NUMBER, "0");
+                    lua_memput(TOK_SEPARATOR, ",");
+                    lua_memnum("%d", n - 1);
+                }
+                lua_memput(TOK_SEPARATOR, " ");
+                lua_memput(TOK_KEYWORD, "do ");
+            }
+            lua_memput(TOK_VARIABLE, t);
+            lua_memput(TOK_SEPARATOR, "(");
+            for(m = 0; m < 2; m++) {
+                if(m && !cpy) lua_callarg(tok, &call, 1, 0);
+                else {
+                    if(n < 2 || run[m]) lua_memnum("0x%x", run[m]);
+                    if(n > 1) {
+                        if(run[m]) lua_memput(TOK_OPERATOR, "+");
+                        lua_memput(TOK_VARIABLE, "__p8_i");
+                        lua_memput(TOK_OPERATOR, "*");
+                        lua_memnum("%d", run[m + 2]);
+                    }
+                }
+                lua_memput(TOK_SEPARATOR, ",");
+            }
+            lua_memnum("%d", run[4]);
+            lua_memput(TOK_SEPARATOR, ")");
+            if(n > 1) lua_memput(TOK_KEYWORD, " end");
+        } else
+            helper = set ? "__p8_memset" : "__p8_memcpy";
+    } else
+    if(w == 4 || n > 1 + poke)
+        /* peek4 and poke4 are 16.16 fixed point on PICO-8, and TIC-80's peek / poke can't read or write more bytes */
+        helper = w == 4 ? (poke ? "__p8_poke4" : "__p8_peek4") : (poke ? "__p8_poke" : "__p8_peek");
+    else
+    if(poke && n < 2) goto keep;
+    else
+    if(w == 2) {
+        if(k == 1 && x >= 0 && (y = lua_memaddr(a + 1, 1, 0, &m)) >= 0 && (!poke || lua_callsimple(tok, &call, 1))) {
+            /* "peek2(a)" -> "(((peek(x)|peek(y)<<8)~32768)-32768)", "poke2(a,v)" -> "poke(x,v//1&255) poke(y,v//1>>8&255)" */
+            if(!poke) lua_memput(TOK_SEPARATOR, "(((");
+            for(m = 0; m < 2; m++) {
+                if(m) lua_memput(poke ? TOK_SEPARATOR : TOK_OPERATOR, poke ? " " : "|");
+                lua_memput(TOK_VARIABLE, t);
+                lua_memput(TOK_SEPARATOR, "(");
+                lua_memnum("0x%x", m ? y : x);
+                if(poke) {
+                    lua_memput(TOK_SEPARATOR, ",");
+                    lua_callarg(tok, &call, 1, 0);
+                    lua_memput(TOK_OPERATOR, m ? "//1>>8&255" : "//1&255");
+                }
+                lua_memput(TOK_SEPARATOR, ")");
+            }
+            if(!poke) lua_memput(TOK_OPERATOR, "<<8)~32768)-32768)");
+        } else
+            helper = poke ? "__p8_poke2" : "__p8_peek2";
+    } else {
+        /* "peek(a)" and "poke(a,v)", the helper's second return value must not be passed as peek's bits argument */
+        if(k && x < 0) goto keep;
+        lua_memput(TOK_VARIABLE, t);
+        lua_memput(TOK_SEPARATOR, "(");
+        if(k == 1) lua_memnum("0x%x", x); else
+        if(k == 2) lua_memexpr(tok, &call, 0, a, x);
+        else {
+            if(!poke) lua_memput(TOK_SEPARATOR, "(");
+            lua_memput(TOK_FUNCTION, "__p8_addr");
+            lua_memput(TOK_SEPARATOR, "(");
+            lua_callarg(tok, &call, 0, 0);
+            lua_memput(TOK_SEPARATOR, ")");
+            if(!poke) lua_memput(TOK_SEPARATOR, ")");
+        }
+        if(poke) {
+            lua_memput(TOK_SEPARATOR, ",");
+            lua_callarg(tok, &call, 1, 0);
+        }
+        lua_memput(TOK_SEPARATOR, ")");
+    }
+#undef lua_memnum
+#undef lua_memput
+    if(helper) {
+        /* just rename the call, the arguments stay */
+        lua_callfree(&call);
+        tmp[0] = TOK_FUNCTION; strcpy(tmp + 1, helper); s = tmp;
+        return tok_splice(tok, idx, w > 1 ? 2 : 1, &s, 1);
+    }
+    return lua_callsplice(tok, idx, &call);
+keep:
+    lua_callfree(&call);
+    return 0;
+}
+
+/* helper lib modules */
+typedef struct {
+    char *defs;     /* space separated list of globals the module defines, NULL if it's always needed */
+    char *deps;     /* space separated list of globals the module uses */
+    char *code;
+} lua_lib_t;
+static int lua_libemit(char *dst, int maxlen, tok_t *tok);
+
+/**
+ * Lua syntax converter, also emits the used parts of the helper lib in front of the converted code
  *   src is zero terminated (but you can also use srclen)
  *   dst is at least 512k (but use maxlen)
+ *   libsize, if not NULL, receives the size of the emitted helper lib
  */
-static int pico_lua_to_tic_lua(char *dst, int maxlen, char *src, int srclen)
+static int pico_lua_to_tic_lua(char *dst, int maxlen, char *src, int srclen, int *libsize)
 {
     tok_t tok;
-    int i, j, k, l, m, len;
-    char tmp[256], *c;
+    int i, j, k, l, m, len, nins = 0;
+    char tmp[256], *c, **ins = NULL, **p;
+    lua_api_t *api;
 
     /* tokenize Lua string */
-    if(!tok_new(&tok, lua_rules, src, srclen)) {
+    if(!tok_newc(&tok, lua_getrules(), src, srclen)) {
         fprintf(stderr, "p8totic: unable to tokenize??? Should never happen!\r\n");
-        memcpy(dst, src, srclen);
-        dst[srclen] = 0;
-        return srclen;
+        len = lua_libemit(dst, maxlen, NULL);
+        if(libsize) *libsize = len;
+        if(srclen > maxlen - len - 1) srclen = maxlen - len - 1;
+        memcpy(dst + len, src, srclen);
+        dst[len + srclen] = 0;
+        return len + srclen;
     }
 
-    /* FIXME: if there's any more syntax or API difference between PICO-8 and TIC-80, replace tokens here.
-     * Also, if you add a Lua API syntax change, remove the relevant part from the helper lib below! */
+    /* FIXME: if there's any more syntax difference between PICO-8 and TIC-80, replace tokens here (API differences
+     * go to lua_api[] above). Also, if you add a Lua API syntax change, remove the relevant part from the helper lib below! */
     for(i = 0; i < tok.num; i++) {
         /*** syntax changes ***/
         /* replace "!=" with "~=" */
-        if(tok.tokens[i] && tok.tokens[i][0] == TOK_OPERATOR && tok.tokens[i][1] == '!' && tok.tokens[i][2] == '=' &&
-          !tok.tokens[i][3]) tok.tokens[i][1] = '~';
+        if(tok_get(&tok, i) && tok_get(&tok, i)[0] == TOK_OPERATOR && tok_get(&tok, i)[1] == '!' && tok_get(&tok, i)[2] == '=' &&
+          !tok_get(&tok, i)[3]) tok_get(&tok, i)[1] = '~';
         /* convert shorthand operators, like "var +=" -> "var = var +" */
-        if(tok.tokens[i][0] == TOK_OPERATOR && strchr("+-*/%&^\\.", tok.tokens[i][1]) && strchr(tok.tokens[i] + 1, '=')) {
-            c = strchr(tok.tokens[i] + 1, '='); *c = 0;
+        if(tok_get(&tok, i)[0] == TOK_OPERATOR && strchr("+-*/%&^\\.", tok_get(&tok, i)[1]) && strchr(tok_get(&tok, i) + 1, '=')) {
+            c = strchr(tok_get(&tok, i) + 1, '='); *c = 0;
             /* variable might consist of multiple tokens, eg. "var[i].field +=" so we need to copy all tokens between */
-            for(j = i - 1, m = 0; j > 0 && (m || tok.tokens[j][0] != TOK_VARIABLE || tok.tokens[j][1] == '.'); j--) {
-                if(tok.tokens[j][1] == ']' || tok.tokens[j][1] == ')') m++;
-                if(tok.tokens[j][1] == '[' || tok.tokens[j][1] == '(') m--;
-                tok_insert(&tok, i, tok.tokens[j][0], tok.tokens[j] + 1);
+            for(j = i - 1, m = 0; j > 0 && (m || tok_get(&tok, j)[0] != TOK_VARIABLE || tok_get(&tok, j)[1] == '.'); j--) {
+                if(tok_get(&tok, j)[1] == ']' || tok_get(&tok, j)[1] == ')') m++;
+                if(tok_get(&tok, j)[1] == '[' || tok_get(&tok, j)[1] == '(') m--;
+            }
+            /* insert "=" and the variable's tokens before the operator at once */
+            if(i - j + 1 > nins) {
+                p = (char**)realloc(ins, (i - j + 1) * sizeof(char*));
+                if(p) { ins = p; nins = i - j + 1; }
+            }
+            if(i - j + 1 <= nins) {
+                tmp[0] = TOK_OPERATOR; tmp[1] = '='; tmp[2] = 0;
+                for(ins[0] = tmp, k = j; k < i; k++)
+                    ins[k - j + 1] = tok_get(&tok, k);
+                tok_splice(&tok, i, 0, ins, i - j + 1);
             }
-            tok_insert(&tok, i, tok.tokens[j][0], tok.tokens[j] + 1);
-            tok_insert(&tok, i, TOK_OPERATOR, "=");
         }
         /* replace "\" with "//" */
-        if(tok.tokens[i][0] == TOK_OPERATOR && !strcmp(tok.tokens[i] + 1, "\\")) {
+        if(tok_get(&tok, i)[0] == TOK_OPERATOR && !strcmp(tok_get(&tok, i) + 1, "\\")) {
             tok_replace(&tok, i, TOK_OPERATOR, "//");
         }
         /* replace "if(expr) cmd" with "if(expr) then cmd end" */
-        if(tok_match(&tok, i, 2, TOK_KEYWORD, TOK_SEPARATOR) && !strcmp(tok.tokens[i] + 1, "if") &&
-          ((i + 1 < tok.num && tok.tokens[i + 1][1] == '(') || (i + 2 < tok.num && tok.tokens[i + 2][1] == '('))) {
-            j = i + (tok.tokens[i + 1][1] == '(' ? 2 : 3);
+        if(tok_match(&tok, i, 2, TOK_KEYWORD, TOK_SEPARATOR) && !strcmp(tok_get(&tok, i) + 1, "if") &&
+          ((i + 1 < tok.num && tok_get(&tok, i + 1)[1] == '(') || (i + 2 < tok.num && tok_get(&tok, i + 2)[1] == '('))) {
+            j = i + (tok_get(&tok, i + 1)[1] == '(' ? 2 : 3);
             k = tok_next(&tok, j, TOK_SEPARATOR, ")");
             if(k < 0) k = tok_next(&tok, j, TOK_SEPARATOR, ") ");
             /* if the last token is an "or" or "and" keyword, then no need to add "then" */
-            if(k > i && k + 1 < tok.num && tok.tokens[k + 1][0] != TOK_KEYWORD) {
-                for(l = k + 1; l < tok.num && (tok.tokens[l][0] != TOK_KEYWORD || strcmp(tok.tokens[l] + 1, "then")); l++)
-                    if(strchr(tok.tokens[l] + 1, '\n')) { l = 0; break; }
+            if(k > i && k + 1 < tok.num && tok_get(&tok, k + 1)[0] != TOK_KEYWORD) {
+                for(l = k + 1; l < tok.num && (tok_get(&tok, l)[0] != TOK_KEYWORD || strcmp(tok_get(&tok, l) + 1, "then")); l++)
+                    if(strchr(tok_get(&tok, l) + 1, '\n')) { l = 0; break; }
                 /* if there was no "then" before the newline */
                 if(!l) {
                     /* add "then" */
                     tok_insert(&tok, k + 1, TOK_KEYWORD, "then ");
                     /* find next token with a newline character */
-                    for(j = k + 2; j < tok.num && !strchr(tok.tokens[j] + 1, '\n'); j++);
+                    for(j = k + 2; j < tok.num && !strchr(tok_get(&tok, j) + 1, '\n'); j++);
                     if(j < tok.num) {
                         /* find newline character and insert "end" before */
-                        for(k = 1, l = m = 0; l < 255 && tok.tokens[j][k]; k++, l++) {
-                            if(!m && tok.tokens[j][k] == '\n') { memcpy(tmp + l, " end", 4); l += 4; m = 1; }
-                            tmp[l] = tok.tokens[j][k];
+                        for(k = 1, l = m = 0; l < 255 && tok_get(&tok, j)[k]; k++, l++) {
+                            if(!m && tok_get(&tok, j)[k] == '\n') { memcpy(tmp + l, " end", 4); l += 4; m = 1; }
+                            tmp[l] = tok_get(&tok, j)[k];
                         }
                         tmp[l] = 0;
-                        tok_replace(&tok, j, tok.tokens[j][0], tmp);
+                        tok_replace(&tok, j, tok_get(&tok, j)[0], tmp);
                     }
                 }
             }
         }
         /* add an extra space between numbers and keywords */
-        if(i + 2 < tok.num && tok.tokens[i] && tok.tokens[i + 1] && tok.tokens[i + 2] &&
-          tok.tokens[i][0] != TOK_VARIABLE && tok.tokens[i + 1][0] == TOK_NUMBER &&
-          (tok.tokens[i + 2][0] == TOK_KEYWORD || tok.tokens[i + 2][0] == TOK_FUNCTION)) {
+        if(i + 2 < tok.num && tok_get(&tok, i) && tok_get(&tok, i + 1) && tok_get(&tok, i + 2) &&
+          tok_get(&tok, i)[0] != TOK_VARIABLE && tok_get(&tok, i + 1)[0] == TOK_NUMBER &&
+          (tok_get(&tok, i + 2)[0] == TOK_KEYWORD || tok_get(&tok, i + 2)[0] == TOK_FUNCTION)) {
             tok_insert(&tok, i + 2, TOK_SEPARATOR, " ");
         }
-        /*** API function name changes ***/
-        if(tok.tokens[i] && tok.tokens[i][0] == TOK_FUNCTION) {
-            /* replace dget and dset with pmem */
-            if(!strcmp(tok.tokens[i] + 1, "dget") || !strcmp(tok.tokens[i] + 1, "dset"))
-                strcpy(tok.tokens[i] + 1, "pmem");
-            /* remove cartdata() */
-            if(!strcmp(tok.tokens[i] + 1, "cartdata")) {
-                j = tok_next(&tok, i + 2, TOK_SEPARATOR, ")");
-                if(j > i) {
-                    for(; j >= i; j--)
-                        tok_delete(&tok, i);
-                }
-            }
-            /* replace shr() and shl() functions with infix operators, like "shl(a,b)" -> "(a<<b)" */
-            if(!strcmp(tok.tokens[i] + 1, "shl") || !strcmp(tok.tokens[i] + 1, "shr")) {
-                j = tok_next(&tok, i + 2, TOK_SEPARATOR, ",");
-                if(j > i) {
-                    tok_replace(&tok, j, TOK_OPERATOR, !strcmp(tok.tokens[i] + 1, "shl") ? "<<" : ">>");
-                    tok_delete(&tok, i);
-                }
-            }
-            /* replace music(track,...) -> music(track) (the other arguments not supported on TIC-80) */
-            if(!strcmp(tok.tokens[i] + 1, "music")) {
-                j = tok_next(&tok, i + 2, TOK_SEPARATOR, ",");
-                if(j > i) {
-                    k = tok_next(&tok, j, TOK_SEPARATOR, ")");
-                    if(k > j) {
-                        for(k -= j; k; k--)
-                            tok_delete(&tok, j);
+        /*** API changes ***/
+        for(m = -1; (k = lua_apifind(tok_get(&tok, i))) > m; m = k) {
+            api = &lua_api[k];
+            switch(api->kind) {
+                case API_RENAME: tok_replace(&tok, i, api->newtype, api->str); break;
+                case API_DROPCALL:
+                    j = tok_next(&tok, i + 2, TOK_SEPARATOR, ")");
+                    if(j > i)
+                        tok_splice(&tok, i, j - i + 1, NULL, 0);
+                break;
+                case API_INFIX: lua_bitop(&tok, i, api->str, 2); break;
+                case API_PREFIX: lua_bitop(&tok, i, api->str, 1); break;
+                case API_ARGTRIM:
+                    j = tok_next(&tok, i + 2, TOK_SEPARATOR, ",");
+                    if(j > i) {
+                        l = tok_next(&tok, j, TOK_SEPARATOR, ")");
+                        if(l > j)
+                            tok_splice(&tok, j, l - j, NULL, 0);
                     }
-                }
+                break;
+                case API_RANDOM:
+                    tok_replace(&tok, i, api->newtype,
+                        i + 3 < tok.num && tok_get(&tok, i + 2)[1] == ')' && tok_get(&tok, i + 3)[1] == '*' ? api->str : api->alt);
+                break;
+                case API_MEMOP: lua_memop(&tok, i); break;
             }
-            /* replace mapdraw() -> map() */
-            if(!strcmp(tok.tokens[i] + 1, "mapdraw")) tok_replace(&tok, i, TOK_FUNCTION, "map");
-            /* replace misc functions */
-            if(!strcmp(tok.tokens[i] + 1, "tostr")) tok_replace(&tok, i, TOK_FUNCTION, "tostring");
-            /* replace math functions */
-            if(!strcmp(tok.tokens[i] + 1, "srand")) tok_replace(&tok, i, TOK_FUNCTION, "math.randomseed");
-            if(!strcmp(tok.tokens[i] + 1, "sqrt"))  tok_replace(&tok, i, TOK_FUNCTION, "math.sqrt");
-            if(!strcmp(tok.tokens[i] + 1, "abs"))   tok_replace(&tok, i, TOK_FUNCTION, "math.abs");
-            if(!strcmp(tok.tokens[i] + 1, "min"))   tok_replace(&tok, i, TOK_FUNCTION, "math.min");
-            if(!strcmp(tok.tokens[i] + 1, "max"))   tok_replace(&tok, i, TOK_FUNCTION, "math.max");
-            if(!strcmp(tok.tokens[i] + 1, "flr"))   tok_replace(&tok, i, TOK_FUNCTION, "math.floor");
-            if(!strcmp(tok.tokens[i] + 1, "rnd"))   tok_replace(&tok, i, TOK_FUNCTION,
-                i + 3 < tok.num && tok.tokens[i + 2][1] == ')' && tok.tokens[i + 3][1] == '*' ? "math.random" : "math.random()*");
-        }
-        if(tok.tokens[i] && tok.tokens[i][0] == TOK_VARIABLE) {
-            if(!strcmp(tok.tokens[i] + 1, "pi"))    tok_replace(&tok, i, TOK_VARIABLE, "math.pi");
-            /* some functions (like btn) accepts special characters as if they were constant variables */
-            if(!strcmp(tok.tokens[i] + 1, "⬇")) tok_replace(&tok, i, TOK_NUMBER, "1"); else     /* Down */
-            if(!strcmp(tok.tokens[i] + 1, "⬅")) tok_replace(&tok, i, TOK_NUMBER, "2"); else     /* Left */
-            if(!strcmp(tok.tokens[i] + 1, "➡")) tok_replace(&tok, i, TOK_NUMBER, "3"); else     /* Right */
-            if(!strcmp(tok.tokens[i] + 1, "⬆")) tok_replace(&tok, i, TOK_NUMBER, "0"); else     /* Up */
-            if(!strcmp(tok.tokens[i] + 1, "🅾")) tok_replace(&tok, i, TOK_NUMBER, "4"); else     /* O */
-            if(!strcmp(tok.tokens[i] + 1, "❎")) tok_replace(&tok, i, TOK_NUMBER, "6");          /* X */
         }
     }
 
-    /* detokenize, aka. serialize into a string */
-    if((len = tok_tostr(&tok, dst, maxlen)) < 1) {
+    /* emit the helper lib, then detokenize, aka. serialize into a string */
+    k = lua_libemit(dst, maxlen, &tok);
+    if(libsize) *libsize = k;
+    if((len = tok_tostr(&tok, dst + k, maxlen - k)) < 1) {
         fprintf(stderr, "p8totic: unable to serialize??? Should never happen!\r\n");
         len = 0;
     }
+    len += k;
     dst[len] = 0;
     tok_free(&tok);
+    if(ins) free(ins);
     return len;
 }
 
@@ -233,9 +832,11 @@ static int pico_lua_to_tic_lua(char *dst, int maxlen, char *src, int srclen)
  * by @musurca
  * https://github.com/musurca/pico2tic
  *
- * by bzt: reformated as a C string, and parts removed that are already converted
+ * by bzt: reformated as a C string, and parts removed that are already converted, split into modules so that only
+ * the ones a cart actually uses are emitted
  */
-char p8totic_lua[] =
+lua_lib_t lua_lib[] = {
+    { NULL, NULL,
 "-- Converted from PICO-8 cartridge by --\n"
 "--  https://bztsrc.gitlab.io/p8totic  --\n"
 "\n"
@@ -268,6 +869,8 @@ char p8totic_lua[] =
 "\n"
 "--sound\n"
 */
+    },
+    { "__sfx sfx", NULL,
 "__sfx=sfx\n"
 "function sfx(n,channel,offset)\n"
 /*" --does not support offset as of 0.18.0\n"*/
@@ -286,6 +889,8 @@ char p8totic_lua[] =
 "end\n"
 "\n"
 */
+    },
+    { "stat", NULL,
 /*"--utility\n"*/
 "function stat(i)\n"
 " if i==0 then\n"
@@ -294,10 +899,14 @@ char p8totic_lua[] =
 " return 0.5\n"
 "end\n"
 "\n"
+    },
+    { "menuitem", NULL,
 "function menuitem(idx,label,callback)\n"
 /*" --do nothing\n"*/
 "end\n"
 "\n"
+    },
+    { "sub", NULL,
 /*"--strings\n"*/
 "function sub(str,i,j)\n"
 " return str:sub(i,j)\n"
@@ -319,13 +928,19 @@ char p8totic_lua[] =
 "\n"
 "--tables\n"
 */
+    },
+    { "add", NULL,
 "add=table.insert\n"
 "\n"
+    },
+    { "all", NULL,
 "function all(list)\n"
 "  local i = 0\n"
 "  return function() i = i + 1; return list[i] end\n"
 "end\n"
 "\n"
+    },
+    { "count", NULL,
 /*"count=table.getn\n"*/
 "function count(t, value)\n"
 "	if value == nil then\n"
@@ -339,6 +954,8 @@ char p8totic_lua[] =
 "   end\n"
 "end\n"
 "\n"
+    },
+    { "del", NULL,
 "function del(t,a)\n"
 "	for i,v in ipairs(t) do\n"
 "		if v==a then\n"
@@ -349,12 +966,16 @@ char p8totic_lua[] =
 "	end\n"
 "end\n"
 "\n"
+    },
+    { "foreach", "all",
 "function foreach(t, f)\n"
 "	for v in all(t) do\n"
 "		f(v)\n"
 "	end\n"
 "end\n"
 "\n"
+    },
+    { "mt", NULL,
 "if mt ~= nil then\n"
 "	mt = {}\n"
 "end\n"
@@ -374,71 +995,109 @@ char p8totic_lua[] =
 "end\n"
 "\n"
 */
+    },
+    { "sgn", NULL,
 "function sgn(a)\n"
 " if a>=0 then return 1 end\n"
 "	return -1\n"
 "end\n"
 "\n"
+    },
+    { "cos", NULL,
 "function cos(a)\n"
 " return math.cos(2*math.pi*a)\n"
 "end\n"
 "\n"
+    },
+    { "sin", NULL,
 "function sin(a)\n"
 " return -math.sin(2*math.pi*a)\n"
 "end\n"
 "\n"
+    },
+    { "atan2", NULL,
 "function atan2(a,b)\n"
 " b=b or 1\n"
 " return math.atan(a,b)/(2*math.pi)\n"
 "end\n"
 "\n"
+    },
+    { "mid", NULL,
 "function mid(a,b,c)\n"
 " if a<=b and a<=c then return math.max(a,math.min(b,c))\n"
 "	elseif b<=a and b<=c then return math.max(b,math.min(a,c)) end\n"
 "	return math.max(c,math.min(a,b))\n"
 "end\n"
 "\n"
+    },
+    { "band", NULL,
 "function band(a,b)\n"
 " return math.floor(a)&math.floor(b)\n"
 "end\n"
 "\n"
+    },
+    { "bor", NULL,
 "function bor(a,b)\n"
 " return math.floor(a)|math.floor(b)\n"
 "end\n"
 "\n"
+    },
+    { "bxor", NULL,
 "function bxor(a,b)\n"
-" return math.floor(a)^math.floor(b)\n"
+" return math.floor(a)~math.floor(b)\n"
 "end\n"
 "\n"
-"function bnot(a,b)\n"
-" return math.floor(a)~math.floor(b)\n"
+    },
+    { "bnot", NULL,
+"function bnot(a)\n"
+" return ~math.floor(a)\n"
 "end\n"
 "\n"
-/*
+    },
+    { "shl", NULL,
 "function shl(a,b)\n"
-" return a<<b\n"
+" return math.floor(a)<<math.floor(b)\n"
 "end\n"
 "\n"
+    },
+    { "shr", NULL,
 "function shr(a,b)\n"
-" return a>>b\n"
+" return math.floor(a)>>math.floor(b)\n"
 "end\n"
 "\n"
-"--graphics\n"
-*/
+    },
+    { "__p8_font", NULL,
 "__p8_font=\"0000000000000000C040E000E0000000C0406000E0000000E060E000E0000000A0E02000E00000006040C000E000000080E0E000E0000000E0202000E000000060E0C000E000000000000000000000000000000000000000C0E0E000E0000000E080E000E00000000000000000000000E0C0E000E0000000E0C08000E0000000E0E0E0E0E000000000E0E0E00000000000E0A0E00000000000A040A00000000000A000A00000000000A0A0A0000000002060E0602000000080C0E0C080000000E08080800000000000202020E0000000A0E040E04000000000004000000000000000008040000000000000C0C0000000A0A000000000000040A040000000000000000000000000004040400040000000A0A0000000000000A0E0A0E0A0000000E0C060E040000000A0204080A0000000C0C060A0E0000000408000000000000040808080400000004020202040000000A040E040A00000000040E0400000000000000040800000000000E0000000000000000000400000002040404080000000E0A0A0A0E0000000C0404040E0000000E020E080E0000000E0206020E0000000A0A0E02020000000E080E020E00000008080E0A0E0000000E020202020000000E0A0E0A0E0000000E0A0E0202000000000400040000000000040004080000000204080402000000000E000E0000000008040204080000000E02060004000000040A0A080600000000060A0E0A000000000C0C0A0E0000000006080806000000000C0A0A0C000000000E0C0806000000000E0C08080000000006080A0E000000000A0A0E0A000000000E04040E000000000E04040C000000000A0C0A0A0000000008080806000000000E0E0A0A000000000C0A0A0A00000000060A0A0C00000000060A0E0800000000040A0C06000000000C0A0C0A000000000608020C000000000E040404000000000A0A0A06000000000A0A0E04000000000A0A0E0E000000000A04040A000000000A0E020C000000000E02080E0000000C0808080C00000008040404020000000602020206000000040A000000000000000000000E00000004020000000000000E0A0E0A0A0000000E0A0C0A0E00000006080808060000000C0A0A0A0E0000000E080C080E0000000E080C08080000000608080A0E0000000A0A0E0A0A0000000E0404040E0000000E0404040C0000000A0A0C0A0A000000080808080E0000000E0E0A0A0A0000000C0A0A0A0A000000060A0A0A0C0000000E0A0E0808000000040A0A0C060000000E0A0C0A0A00000006080E020C0000000E040404040000000A0A0A0A060000000A0A0A0E040000000A0A0A0E0E0000000A0A040A0A0000000A0A0E020E0000000E0204080E00000006040C040600000004040404040000000C0406040C00000000020E08000000000\"\n"
+    },
+    { "__p8_pal", NULL,
 "__p8_pal=\"0000001D2B537E2553008751AB52365F574FC2C3C7FFF1E8FF004DFFA300FFEC2700E43629ADFF83769CFF77A8FFCCAA\"\n"
+    },
+    { "__p8_color", NULL,
 "__p8_color=7\n"
+    },
+    { "__p8_ctrans __p8_ckey __p8_ckeyset", NULL,
 "__p8_ctrans={true,false,false,false,false,false,false,false,\n"
 "             false,false,false,false,false,false,false,false}\n"
+"-- colorkey for spr, a single color or a table, updated by palt\n"
+"__p8_ckey=0\n"
+"function __p8_ckeyset()\n"
+"	local k={}\n"
+"	for i=1,16 do\n"
+"		if __p8_ctrans[i] then k[#k+1]=i-1 end\n"
+"	end\n"
+"	if #k==0 then k=-1 elseif #k==1 then k=k[1] end\n"
+"	__p8_ckey=k\n"
+"end\n"
+    },
+    { "__p8_camera_x __p8_camera_y", NULL,
 "__p8_camera_x=0\n"
 "__p8_camera_y=0\n"
+    },
+    { "__p8_cursor_x __p8_cursor_y", NULL,
 "__p8_cursor_x=0\n"
 "__p8_cursor_y=0\n"
-"__p8_sflags={}\n"
-"for i=0,255 do\n"
-" __p8_sflags[i+1]=peek(0x14404+i)\n"
-"end\n"
-"\n"
+    },
+    { "__clip clip", NULL,
 "__clip=clip\n"
 "function clip(x,y,w,h)\n"
 "	if x==nil then\n"
@@ -449,6 +1108,8 @@ char p8totic_lua[] =
 "	end\n"
 "end\n"
 "\n"
+    },
+    { "camera", "__p8_camera_x",
 "function camera(cx,cy)\n"
 "	cx=cx or 0\n"
 "	cy=cy or 0\n"
@@ -456,6 +1117,8 @@ char p8totic_lua[] =
 "	__p8_camera_y=-math.floor(cy)\n"
 "end\n"
 "\n"
+    },
+    { "cursor", "__p8_cursor_x",
 "function cursor(cx,cy)\n"
 "	cx=cx or 0\n"
 "	cy=cy or 0\n"
@@ -463,11 +1126,15 @@ char p8totic_lua[] =
 "	__p8_cursor_y=math.floor(cy)\n"
 "end\n"
 "\n"
+    },
+    { "__p8_coord", "__p8_camera_x",
 "function __p8_coord(x,y)\n"
 " return math.floor(x+__p8_camera_x),\n"
 "	       math.floor(y+__p8_camera_y)\n"
 "end\n"
 "\n"
+    },
+    { "__print print", "__p8_cursor_x __p8_color __p8_font",
 "__print=print\n"
 "function print(str,x,y,c)\n"
 "	x=x or __p8_cursor_x\n"
@@ -478,11 +1145,15 @@ char p8totic_lua[] =
 "	__p8_cursor_y=y+8\n"
 "end\n"
 "\n"
+    },
+    { "color", "__p8_color",
 "function color(c)\n"
 "	c=c or 7\n"
 "	__p8_color=math.floor(c%16)\n"
 "end\n"
 "\n"
+    },
+    { "pal", "__p8_pal",
 "function pal(c0,c1,type)\n"
 "	c0=c0 or -1\n"
 "	c1=c1 or -1\n"
@@ -512,6 +1183,8 @@ char p8totic_lua[] =
 "	end\n"
 "end\n"
 "\n"
+    },
+    { "palt", "__p8_ctrans __p8_ckeyset",
 "function palt(c,trans)\n"
 "	c=c or -1\n"
 "	if c<0 then -- reset\n"
@@ -522,8 +1195,11 @@ char p8totic_lua[] =
 "	else\n"
 "	 __p8_ctrans[math.floor(c%16)+1]=trans\n"
 "	end\n"
+"	__p8_ckeyset()\n"
 "end\n"
 "\n"
+    },
+    { "pset", "__p8_color __p8_coord",
 "function pset(x,y,c)\n"
 "	c=c or __p8_color\n"
 "	c=peek4(0x7FE0+c)\n"
@@ -531,11 +1207,15 @@ char p8totic_lua[] =
 " poke4(y*240+x,c) 	\n"
 "end\n"
 "\n"
+    },
+    { "pget", "__p8_coord",
 "function pget(x,y)\n"
 "	x,y=__p8_coord(x,y)\n"
 "	return peek4(y*240+x)\n"
 "end\n"
 "\n"
+    },
+    { "__rect rectfill", "__p8_color __p8_coord sgn",
 "__rect=rect\n"
 "function rectfill(x0,y0,x1,y1,c)\n"
 "	c=c or __p8_color\n"
@@ -546,6 +1226,8 @@ char p8totic_lua[] =
 "	__rect(x0,y0,w+sgn(w),h+sgn(h),c)\n"
 "end\n"
 "\n"
+    },
+    { "rect", "__p8_color __p8_coord sgn",
 "function rect(x0,y0,x1,y1,c)\n"
 "	c=c or __p8_color\n"
 "	c=peek4(0x7FE0+c)\n"
@@ -555,6 +1237,8 @@ char p8totic_lua[] =
 "	rectb(x0,y0,w+sgn(w),h+sgn(h),c) \n"
 "end\n"
 "\n"
+    },
+    { "__circ circfill", "__p8_color __p8_coord",
 "__circ=circ\n"
 "function circfill(x,y,r,c)\n"
 "	c=c or __p8_color\n"
@@ -563,6 +1247,8 @@ char p8totic_lua[] =
 "	__circ(x,y,r,c)\n"
 "end\n"
 "\n"
+    },
+    { "circ", "__p8_color __p8_coord",
 "function circ(x,y,r,c)\n"
 "	c=c or __p8_color\n"
 "	c=peek4(0x7FE0+c)\n"
@@ -570,6 +1256,8 @@ char p8totic_lua[] =
 "	circb(x,y,r,c)\n"
 "end\n"
 "\n"
+    },
+    { "__line line", "__p8_color __p8_coord",
 "__line=line\n"
 "function line(x0,y0,x1,y1,c)\n"
 "	c=c or __p8_color\n"
@@ -579,6 +1267,8 @@ char p8totic_lua[] =
 " __line(x0,y0,x1,y1,c)\n"
 "end\n"
 "\n"
+    },
+    { "ovalfill", NULL,
 "function ovalfill(x0, y0, x1, y1, color)\n"
 "	local cx = math.floor((x0 + x1) / 2)\n"
 "	local cy = math.floor((y0 + y1) / 2)\n"
@@ -587,107 +1277,206 @@ char p8totic_lua[] =
 "	elli(cx, cy, rx, ry, color)\n"
 "end\n"
 "\n"
-"function sspr(sx,sy,sw,sh,dx,dy,dw,dh) -- todo\n"
+    },
+    { "sspr", "__p8_coord __p8_ckey __spr",
+"function sspr(sx,sy,sw,sh,dx,dy,dw,dh,flip_x,flip_y)\n"
 "	dw=dw or sw\n"
 "	dh=dh or sh\n"
-" dx,dy=__p8_coord(dx,dy)\n"
-"	if dx>240 or dy>136 then return end\n"
-"	local xscale,yscale=dw/sw,dh/sh	\n"
-"	local startx,starty,c=0,0\n"
-" if dx<0 then startx=-dx end\n"
-"	if dy<0 then starty=-dy end\n"
-"	if dx+dw>240 then dw=240-dx end\n"
-"	if dy+dh>136 then dh=136-dy end\n"
-"	for x=startx,dw-1 do\n"
-"	 for y=starty,dh-1 do\n"
-"		 c=sget(sx+x/xscale,sy+y/yscale)\n"
-"			c=peek4(0x7FE0+c)\n"
-"			if not __p8_ctrans[c+1] then\n"
-"		  poke4((dy+y)*240+dx+x,c)\n"
-"			end\n"
-"		end\n"
+"	dx,dy=__p8_coord(dx,dy)\n"
+"	if dw==sw and dh==sh and sx%8==0 and sy%8==0 and sw%8==0 and sh%8==0 then\n"
+"		-- whole sprites, unscaled\n"
+"		local flip=0\n"
+"		if flip_x then flip=1 end\n"
+"		if flip_y then flip=flip+2 end\n"
+"		__spr(sy//8*16+sx//8,dx,dy,__p8_ckey,1,flip,0,sw//8,sh//8)\n"
+"		return\n"
 "	end\n"
+"	-- scaled, two textured triangles\n"
+"	local u0,v0,u1,v1=sx,sy,sx+sw,sy+sh\n"
+"	local x1,y1=dx+dw,dy+dh\n"
+"	if flip_x then u0,u1=u1,u0 end\n"
+"	if flip_y then v0,v1=v1,v0 end\n"
+"	ttri(dx,dy,x1,dy,dx,y1,u0,v0,u1,v0,u0,v1,0,__p8_ckey)\n"
+"	ttri(x1,dy,dx,y1,x1,y1,u1,v0,u0,v1,u1,v1,0,__p8_ckey)\n"
 "end\n"
 "\n"
+    },
+    { "__spr spr", "__p8_ckey",
 "__spr=spr\n"
 "function spr(n, x, y, w, h, flip_x, flip_y)\n"
-"	x = x or 0\n"
-"	y = y or 0\n"
-"	w = w or 1\n"
-"	h = h or 1\n"
-"	flip_x = flip_x or false\n"
-"	flip_y = flip_y or false\n"
 "	local flip = 0\n"
-"	if flip_x then flip = flip + 1 end\n"
+"	if flip_x then flip = 1 end\n"
 "	if flip_y then flip = flip + 2 end\n"
-"	local colorkey = {}\n"
-"	for color_index, is_transparent in ipairs(__p8_ctrans) do\n"
-"		if is_transparent then\n"
-"			table.insert(colorkey, color_index - 1) -- TIC-80 uses 0-based colors\n"
-"		end\n"
-"	end\n"
-"	__spr(n, x, y, colorkey, 1, flip, 0, w, h)\n"
+"	__spr(n, x or 0, y or 0, __p8_ckey, 1, flip, 0, w or 1, h or 1)\n"
 "end\n"
 "\n"
+    },
+    { "__map map", "__p8_coord __p8_ckey __spr",
 "__map=map\n"
-"function map(cel_x,cel_y,sx,sy,cel_w,cel_h)\n"
-" sx,sy=__p8_coord(sx,sy)\n"
-" local cel\n"
+"function map(cel_x,cel_y,sx,sy,cel_w,cel_h,layer)\n"
+"	cel_x=cel_x or 0\n"
+"	cel_y=cel_y or 0\n"
+"	cel_w=cel_w or 128\n"
+"	cel_h=cel_h or 64\n"
+"	sx,sy=__p8_coord(sx or 0,sy or 0)\n"
+"	if layer==nil or layer==0 then\n"
+"		__map(cel_x,cel_y,cel_w,cel_h,sx,sy,__p8_ckey)\n"
+"		return\n"
+"	end\n"
+"	-- only the sprites that have all the layer's flags\n"
+"	local cel\n"
 "	for cy=0,cel_h-1 do\n"
-"	 for cx=0,cel_w-1 do\n"
-"		 cel=mget(cx+cel_x,cy+cel_y)\n"
-"			spr(cel,sx+cx*8,sy+cy*8)\n"
+"		for cx=0,cel_w-1 do\n"
+"			cel=mget(cx+cel_x,cy+cel_y)\n"
+"			if peek(0x14404+cel)&layer==layer then\n"
+"				__spr(cel,sx+cx*8,sy+cy*8,__p8_ckey)\n"
+"			end\n"
 "		end\n"
 "	end\n"
-"	\n"
-/*"	--__map(cel_x,cel_y,cel_w,cel_h,sx,sy,__p8_ctrans)\n"*/
 "end\n"
-/*
-"mapdraw=map\n"
 "\n"
-*/
+    },
+    { "sset", NULL,
 "function sset(x,y,c) \n"
 " x,y=math.floor(x),math.floor(y)\n"
 "	local addr=0x8000+64*(math.floor(x/8)+math.floor(y/8)*16)\n"
 "	poke4(addr+(y%8)*8+x%8,c)\n"
 "end\n"
 "\n"
+    },
+    { "sget", NULL,
 "function sget(x,y)\n"
 " x,y=math.floor(x),math.floor(y)\n"
 " local addr=0x8000+64*(math.floor(x/8)+math.floor(y/8)*16)\n"
 "	return peek4(addr+(y%8)*8+x%8)\n"
 "end\n"
 "\n"
+    },
+    { "__p8_addr", NULL,
+/*"-- PICO-8 address to TIC-80 RAM, and how many bytes (at most l) are contiguous there\n"*/
+"function __p8_addr(a,l,t)\n"
+" a,l=a//1,l or 1\n"
+" local m\n"
+" if a>=0 and a<0x2000 then\n"
+"  local x,y=a%64,a//64\n"
+"  if t and x==0 and y%8==0 and l>=512 then\n"
+"   return 0x4000+a,math.min(l-l%512,0x2000-a)\n"
+"  end\n"
+"  a,m=0x4000+(y//8*16+x//4)*32+y%8*4+x%4,4-x%4\n"
+" elseif a>=0x2000 and a<0x3000 then\n"
+"  a=a-0x2000\n"
+"  a,m=0x8000+a//128*240+a%128,128-a%128\n"
+" elseif a>=0x3000 and a<0x3100 then\n"
+"  a,m=a+0x11404,0x3100-a\n"
+" elseif a>=0x4300 and a<0x5e00 then\n"
+"  a,m=a+0x10b24,0x5e00-a\n"
+" elseif a>=0x6000 and a<0x8000 then\n"
+"  a=a-0x6000\n"
+"  a,m=a//64*120+a%64,64-a%64\n"
+" else\n"
+"  return a,l\n"
+" end\n"
+" return a,math.min(l,m)\n"
+"end\n"
+"\n"
+    },
+    { "__p8_peek __p8_poke", "__p8_addr",
+"function __p8_peek(a,n)\n"
+" local r={}\n"
+" for i=1,n or 1 do r[i]=peek((__p8_addr(a+i-1))) end\n"
+" return table.unpack(r)\n"
+"end\n"
+"function __p8_poke(a,...)\n"
+" for i,v in ipairs({...}) do poke(__p8_addr(a+i-1),v) end\n"
+"end\n"
+"\n"
+    },
+    { "__p8_peek2 __p8_poke2", "__p8_addr",
+"function __p8_peek2(a)\n"
+" return ((peek((__p8_addr(a)))|peek((__p8_addr(a+1)))<<8)~32768)-32768\n"
+"end\n"
+"function __p8_poke2(a,v)\n"
+" v=v//1\n"
+" poke(__p8_addr(a),v&255)\n"
+" poke(__p8_addr(a+1),v>>8&255)\n"
+"end\n"
+"\n"
+    },
+    { "__p8_peek4 __p8_poke4", "__p8_addr",
+/*"-- 16.16 fixed point numbers\n"*/
+"function __p8_peek4(a)\n"
+" local v=0\n"
+" for i=3,0,-1 do v=v<<8|peek((__p8_addr(a+i))) end\n"
+" return ((v~0x80000000)-0x80000000)/65536\n"
+"end\n"
+"function __p8_poke4(a,v)\n"
+" v=math.floor(v*65536)\n"
+" for i=0,3 do poke(__p8_addr(a+i),v>>i*8&255) end\n"
+"end\n"
+"\n"
+    },
+    { "__p8_memcpy __p8_memset", "__p8_addr",
+"function __p8_memcpy(d,s,l)\n"
+" local a,b,m,t\n"
+" if d>s and d<s+l then\n"
+"  for i=l-1,0,-1 do poke(__p8_addr(d+i),peek((__p8_addr(s+i)))) end\n"
+"  return\n"
+" end\n"
+" while l>0 do\n"
+"  t=d>=0 and s>=0 and d<0x2000 and s<0x2000 and d%512==0 and s%512==0\n"
+"  a,m=__p8_addr(d,l,t)\n"
+"  b,m=__p8_addr(s,m,t)\n"
+"  memcpy(a,b,m)\n"
+"  d,s,l=d+m,s+m,l-m\n"
+" end\n"
+"end\n"
+"function __p8_memset(d,v,l)\n"
+" local a,m\n"
+" while l>0 do\n"
+"  a,m=__p8_addr(d,l,true)\n"
+"  memset(a,v,m)\n"
+"  d,l=d+m,l-m\n"
+" end\n"
+"end\n"
+"\n"
+    },
+    { "flip", NULL,
 "function flip()\n"
 /*" --do nothing\n"*/
 "end\n"
 "\n"
 /*"--sprite flags\n"*/
+    },
+    { "fset", NULL,
 "function fset(n,f,v)\n"
 "	if f>7 then\n"
-"	 __p8_sflags[n+1]=f\n"
+"	 poke(0x14404+n,f)\n"
 "	else	 \n"
-"	 local flags=__p8_sflags[n+1]\n"
+"	 local flags=peek(0x14404+n)\n"
 "	 if v then\n"
 "	  flags=flags|(1<<f)\n"
 "		else\n"
 "		 flags=flags&~(1<<f)\n"
 "		end\n"
-"	 __p8_sflags[n+1]=flags	\n"
+"	 poke(0x14404+n,flags)\n"
 "	end\n"
 "end\n"
 "\n"
+    },
+    { "fget", NULL,
 "function fget(n,f)\n"
 " f=f or -1\n"
 "	if f<0 then\n"
-"	 return __p8_sflags[n+1]\n"
+"	 return peek(0x14404+n)\n"
 "	end\n"
-"	local flags=__p8_sflags[n+1]\n"
+"	local flags=peek(0x14404+n)\n"
 "	if flags&(1<<f)>0 then return true end\n"
 "	return false\n"
 "end\n"
 "\n"
 /*"--input\n"*/
+    },
+    { "pico8ButtonMap", NULL,
 "pico8ButtonMap = {}\n"
 "pico8ButtonMap[1] = 2 -- 0 left\n"
 "pico8ButtonMap[2] = 3 -- 1 right\n"
@@ -697,17 +1486,25 @@ char p8totic_lua[] =
 "pico8ButtonMap[6] = 5 -- 5 x\n"
 "pico8ButtonMap[7] = 6 -- 6 start\n"
 "pico8ButtonMap[8] = 7 -- 7 Doesn\'t exist\n"
+    },
+    { "pico8ButtonCache", NULL,
 "pico8ButtonCache = {}\n"
+    },
+    { "pico8ButtonToTic80", "pico8ButtonMap",
 "function pico8ButtonToTic80(i, p)\n"
 "	if p == nil then\n"
 "		p = 0\n"
 "	end\n"
 "	return p * 8 + pico8ButtonMap[i + 1]\n"
 "end\n"
+    },
+    { "__btn btn", "pico8ButtonToTic80",
 "__btn = btn\n"
 "function btn(i, p)\n"
 "	return __btn(pico8ButtonToTic80(i, p))\n"
 "end\n"
+    },
+    { "__btnp btnp", "pico8ButtonToTic80 pico8ButtonCache",
 "__btnp = btnp\n"
 "function btnp(i, p)\n"
 "	local j = pico8ButtonToTic80(i, p)\n"
@@ -716,6 +1513,8 @@ char p8totic_lua[] =
 "	return ret\n"
 "end\n"
 "\n"
+    },
+    { "_btnp_clear", "pico8ButtonCache",
 "function _btnp_clear()\n"
 "	for i = 0,31 do\n"
 "		pico8ButtonCache[i] = false\n"
@@ -723,11 +1522,15 @@ char p8totic_lua[] =
 "end\n"
 "\n"
 /*"-- TIC function to call pico-8 callbacks.\n"*/
+    },
+    { NULL, "__btnp pico8ButtonToTic80 pico8ButtonCache _btnp_clear clip rectfill",
 "__updateTick = true\n"
 "function BOOT()\n"
 /*"	-- Initialize\n"*/
-"	for i=0,1023 do\n"
-"		poke(0x14604 + i, tonumber(string.sub(__p8_font,i*2+1,i*2+2),16))\n"
+"	if __p8_font ~= nil then\n"
+"		for i=0,1023 do\n"
+"			poke(0x14604 + i, tonumber(string.sub(__p8_font,i*2+1,i*2+2),16))\n"
+"		end\n"
 "	end\n"
 "	cls()\n"
 /*"	PICO8_PALETTE()\n"*/
@@ -768,4 +1571,735 @@ char p8totic_lua[] =
 "	rectfill(0,128,240,136,0)\n"
 "end\n"
 "\n"
-"-- Add pico-8 cart below!\n";
+"-- Add pico-8 cart below!\n"
+    }
+};
+
+/* lightweight variants of the drawing functions, used instead of the modules with the same defs if the cart never
+ * calls camera() nor pal(). These call the TIC-80 primitives directly, without the camera offset and palette lookup */
+lua_lib_t lua_liblite[] = {
+    { "pset", "__p8_color",
+"function pset(x,y,c)\n"
+"	pix(x//1,y//1,c or __p8_color)\n"
+"end\n"
+"\n"
+    },
+    { "__rect rectfill", "__p8_color sgn",
+"__rect=rect\n"
+"function rectfill(x0,y0,x1,y1,c)\n"
+"	x0,y0=x0//1,y0//1\n"
+"	local w,h=x1//1-x0,y1//1-y0\n"
+"	__rect(x0,y0,w+sgn(w),h+sgn(h),c or __p8_color)\n"
+"end\n"
+"\n"
+    },
+    { "rect", "__p8_color sgn",
+"function rect(x0,y0,x1,y1,c)\n"
+"	x0,y0=x0//1,y0//1\n"
+"	local w,h=x1//1-x0,y1//1-y0\n"
+"	rectb(x0,y0,w+sgn(w),h+sgn(h),c or __p8_color)\n"
+"end\n"
+"\n"
+    },
+    { "__circ circfill", "__p8_color",
+"__circ=circ\n"
+"function circfill(x,y,r,c)\n"
+"	__circ(x//1,y//1,r,c or __p8_color)\n"
+"end\n"
+"\n"
+    },
+    { "circ", "__p8_color",
+"function circ(x,y,r,c)\n"
+"	circb(x//1,y//1,r,c or __p8_color)\n"
+"end\n"
+"\n"
+    },
+    { "__line line", "__p8_color",
+"__line=line\n"
+"function line(x0,y0,x1,y1,c)\n"
+" __line(x0//1,y0//1,x1//1,y1//1,c or __p8_color)\n"
+"end\n"
+"\n"
+    }
+};
+
+#define LUA_LIBHASH 256
+typedef struct {
+    char *name;
+    int len, mod;
+} lua_libname_t;
+static lua_libname_t *lua_libhash = NULL;
+
+/**
+ * Look up a global in the helper lib, returns the index of the module that defines it or -1. The hash table is built
+ * on first call (thread safe, the same way as lua_getrules())
+ */
+static int lua_libfind(char *s, int l)
+{
+    lua_libname_t *h = __atomic_load_n(&lua_libhash, __ATOMIC_ACQUIRE), *expected = NULL;
+    int i, j, k;
+    char *c;
+
+    if(!h) {
+        if(!(h = (lua_libname_t*)calloc(LUA_LIBHASH, sizeof(lua_libname_t)))) return -1;
+        for(i = 0; i < (int)(sizeof(lua_lib) / sizeof(lua_lib[0])); i++)
+            for(c = lua_lib[i].defs; c && *c; c += k + (c[k] == ' ')) {
+                k = strcspn(c, " ");
+                for(j = lua_hash(c, k) & (LUA_LIBHASH - 1); h[j].name; j = (j + 1) & (LUA_LIBHASH - 1));
+                h[j].name = c; h[j].len = k; h[j].mod = i;
+            }
+        if(!__atomic_compare_exchange_n(&lua_libhash, &expected, h, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(h);
+            h = expected;
+        }
+    }
+    for(j = lua_hash(s, l) & (LUA_LIBHASH - 1); h[j].name; j = (j + 1) & (LUA_LIBHASH - 1))
+        if(h[j].len == l && !memcmp(h[j].name, s, l)) return h[j].mod;
+    return -1;
+}
+
+/**
+ * Returns the size of the whole helper lib (the most lua_libemit() could ever write)
+ */
+static int lua_libsize(void)
+{
+    int i, l = 0;
+
+    for(i = 0; i < (int)(sizeof(lua_lib) / sizeof(lua_lib[0])); i++)
+        l += strlen(lua_lib[i].code);
+    for(i = 0; i < (int)(sizeof(lua_liblite) / sizeof(lua_liblite[0])); i++)
+        l += strlen(lua_liblite[i].code);
+    return l;
+}
+
+/**
+ * Emit the helper lib modules reachable from the identifiers in tok (or all of them if tok is NULL), returns the
+ * number of bytes written to dst. If the cart never calls camera() nor pal(), then the lua_liblite[] variants of the
+ * drawing functions are used
+ */
+static int lua_libemit(char *dst, int maxlen, tok_t *tok)
+{
+    int num = sizeof(lua_lib) / sizeof(lua_lib[0]), stk[sizeof(lua_lib) / sizeof(lua_lib[0])];
+    int i, j, k, l, n = 0, len = 0;
+    char sel[sizeof(lua_lib) / sizeof(lua_lib[0])], *c, name[64];
+    lua_lib_t *mod[sizeof(lua_lib) / sizeof(lua_lib[0])];
+
+    /* modules that are always needed and the ones defining a global used by the cart */
+    for(i = 0; i < num; i++) {
+        mod[i] = &lua_lib[i];
+        if((sel[i] = !tok || !lua_lib[i].defs)) stk[n++] = i;
+    }
+    for(i = 0; tok && i < tok->num; i++) {
+        c = tok_get(tok, i);
+        if((c[0] != TOK_FUNCTION && c[0] != TOK_VARIABLE) || c[1] == '.') continue;
+        /* for "a.b" or "a:b" only "a" is a global, and the tokenizer splits words at digits, like "atan2" */
+        for(l = 0, j = i; l < (int)sizeof(name) - 1;) {
+            for(c++; lua_isword(*c) && l < (int)sizeof(name) - 1; c++) name[l++] = *c;
+            if(*c || ++j >= tok->num) break;
+            c = tok_get(tok, j);
+            if(*c != TOK_NUMBER && *c != TOK_VARIABLE && *c != TOK_FUNCTION) break;
+        }
+        if((j = lua_libfind(name, l)) != -1 && !sel[j]) { sel[j] = 1; stk[n++] = j; }
+    }
+    /* without camera offset and palette changes the lightweight drawing functions will do */
+    if(tok && (i = lua_libfind("camera", 6)) != -1 && !sel[i] && (j = lua_libfind("pal", 3)) != -1 && !sel[j])
+        for(i = 0; i < (int)(sizeof(lua_liblite) / sizeof(lua_liblite[0])); i++)
+            if((j = lua_libfind(lua_liblite[i].defs, strcspn(lua_liblite[i].defs, " "))) != -1) mod[j] = &lua_liblite[i];
+    /* add their dependencies too */
+    while(n > 0)
+        for(c = mod[stk[--n]]->deps; c && *c; c += k + (c[k] == ' ')) {
+            k = strcspn(c, " ");
+            if((j = lua_libfind(c, k)) != -1 && !sel[j]) { sel[j] = 1; stk[n++] = j; }
+        }
+    /* emit them in their original order */
+    for(i = 0; i < num; i++)
+        if(sel[i]) {
+            l = strlen(mod[i]->code);
+            if(len + l >= maxlen) break;
+            memcpy(dst + len, mod[i]->code, l);
+            len += l;
+        }
+    dst[len] = 0;
+    return len;
+}
+
+
+/* helper lib globals that aren't part of the PICO-8 API, so the minifier can rename them */
+char *lua_libpriv[] = { "__sfx", "__p8_font", "__p8_pal", "__p8_color", "__p8_ctrans", "__p8_ckey", "__p8_ckeyset",
+    "__p8_camera_x", "__p8_camera_y", "__p8_cursor_x", "__p8_cursor_y", "__clip", "__p8_coord",
+    "__print", "__rect", "__circ", "__line", "__spr", "__map", "__p8_addr", "__p8_peek", "__p8_poke", "__p8_peek2",
+    "__p8_poke2", "__p8_peek4", "__p8_poke4", "__p8_memcpy", "__p8_memset", "pico8ButtonMap", "pico8ButtonCache",
+    "pico8ButtonToTic80", "__btn", "__btnp", "_btnp_clear", "__updateTick", NULL };
+/* globals looked up by name from outside of the script (Lua and TIC-80 API, callbacks), these are never renamed */
+char *lua_extern[] = { "_G", "_ENV", "_VERSION", "self", "arg", "goto", "assert", "collectgarbage", "error",
+    "getmetatable", "ipairs", "load", "next", "pairs", "pcall", "rawequal", "rawget", "rawlen", "rawset", "require",
+    "select", "setmetatable", "tonumber", "tostring", "type", "xpcall", "coroutine", "debug", "math", "os", "string",
+    "table", "utf8", "BOOT", "TIC", "SCN", "OVR", "BDR", "MENU", "btn", "btnp", "circ", "circb", "clip", "cls", "elli",
+    "ellib", "exit", "fget", "font", "fset", "key", "keyp", "line", "map", "memcpy", "memset", "mget", "mouse", "mset",
+    "music", "peek", "peek1", "peek2", "peek4", "pix", "pmem", "poke", "poke1", "poke2", "poke4", "print", "rect",
+    "rectb", "reset", "sfx", "spr", "sync", "time", "tstamp", "trace", "tri", "trib", "textri", "ttri", "vbank",
+    "_init", "_update", "_update60", "_draw", NULL };
+
+/* minifier identifier */
+typedef struct {
+    char *str;
+    int len, cnt;   /* name and how many times it's used as a variable */
+    char flags;     /* LUA_MIN_* bits */
+    char nn[8];     /* new name, empty if it's not renamed */
+} lua_minid_t;
+enum { LUA_MIN_LOCAL = 1, LUA_MIN_FIELD = 2, LUA_MIN_FIXED = 4 };
+/* minifier state */
+typedef struct {
+    tok_t *tok;
+    lua_minid_t *ids;   /* identifiers hash table */
+    int size;           /* its size, a power of two, always with plenty of free slots */
+    char *names;        /* identifier strings (a word might be split into more tokens, so they are copied here) */
+    int nlen;
+    char *dst;          /* output, NULL while collecting the identifiers */
+    int len, maxlen;
+    int pend;           /* skipped whitespace, 1 space, 2 newline */
+    int num;            /* last character written belongs to a number */
+    unsigned char lc;   /* last character written */
+} lua_min_t;
+
+
+/**
+ * Find an identifier in the minifier's hash table, adds it if it's not there yet
+ */
+static lua_minid_t *lua_minid(lua_min_t *m, char *s, int l)
+{
+    int j;
+
+    for(j = lua_hash(s, l) & (m->size - 1); m->ids[j].str; j = (j + 1) & (m->size - 1))
+        if(m->ids[j].len == l && !memcmp(m->ids[j].str, s, l)) return &m->ids[j];
+    m->ids[j].str = m->names + m->nlen; m->ids[j].len = l;
+    memcpy(m->names + m->nlen, s, l);
+    m->names[m->nlen + l] = 0;
+    m->nlen += l + 1;
+    return &m->ids[j];
+}
+
+/**
+ * Returns true if the word is a Lua keyword
+ */
+static int lua_iskw(char *s, int l)
+{
+    int i;
+
+    for(i = 0; lua_kws[i]; i++)
+        if(lua_kws[i][0] == s[0] && (int)strlen(lua_kws[i]) == l && !memcmp(lua_kws[i], s, l)) return 1;
+    for(i = 0; lua_typ[i]; i++)
+        if(lua_typ[i][0] == s[0] && (int)strlen(lua_typ[i]) == l && !memcmp(lua_typ[i], s, l)) return 1;
+    return 0;
+}
+
+/**
+ * Copy at most n characters of code from the i-th token's k-th position on, across token boundaries. If ws is set,
+ * then whitespace and comments are skipped
+ */
+static int lua_minpeek(tok_t *tok, int i, int k, char *buf, int n, int ws)
+{
+    char *t;
+    int l = 0;
+
+    for(; l < n && i < tok->num; i++, k = 1)
+        if((t = tok_get(tok, i))[0] != TOK_COMMENT || !ws)
+            for(; l < n && t[k]; k++)
+                if(!ws || !lua_isspace(t[k])) buf[l++] = t[k];
+    return l;
+}
+
+/**
+ * Returns the length of a long bracket "[==[" or "]==]" (c is the bracket) at the k-th character of the i-th token,
+ * or 0. The level is returned in lvl, or if it's not -1, then the bracket must be of that level
+ */
+static int lua_minbracket(tok_t *tok, int i, int k, char c, int *lvl)
+{
+    char buf[64];
+    int n = lua_minpeek(tok, i, k, buf, sizeof(buf), 0), l;
+
+    if(n < 2 || buf[0] != c) return 0;
+    for(l = 1; l < n && buf[l] == '='; l++);
+    if(l >= n || buf[l] != c || (*lvl != -1 && *lvl != l - 1)) return 0;
+    *lvl = l - 1;
+    return l + 1;
+}
+
+/**
+ * Write out a character, with a space or newline before it if the skipped whitespace was significant
+ */
+static void lua_minput(lua_min_t *m, unsigned char c, int num)
+{
+    if(m->pend && ((lua_isword(m->lc) && lua_isword(c)) || (m->lc == '-' && c == '-') || (m->lc == '.' && c == '.') ||
+      (m->lc == '[' && (c == '[' || c == '=')) || (m->num && c == '.'))) {
+        if(m->dst && m->len < m->maxlen) m->dst[m->len] = m->pend > 1 ? '\n' : ' ';
+        m->len++;
+    }
+    if(m->dst && m->len < m->maxlen) m->dst[m->len] = c;
+    m->len++; m->lc = c; m->num = num; m->pend = 0;
+}
+
+/**
+ * Serialize the tokens without comments and insignificant whitespace, renaming identifiers. If m->dst is NULL, then
+ * it collects the identifiers instead. Returns 0 if the tokens can't be minified
+ */
+static int lua_minemit(lua_min_t *m)
+{
+    tok_t *tok = m->tok;
+    lua_minid_t *id;
+    int i, k, l, n, st = 0, lvl = 0, skip = 0, ds = 0, field;
+    char *t, word[256], pc = 0, ppc = 0;
+
+    for(i = 0; i < tok->num; i++) {
+        t = tok_get(tok, i);
+        k = 1;
+        if(!st && !skip) {
+            if(t[0] == TOK_STRING) {
+                for(; t[k]; k++) lua_minput(m, t[k], 0);
+                ppc = pc; pc = '\"'; ds = 0;
+                continue;
+            }
+            if(t[0] == TOK_COMMENT) {
+                /* a long comment "--[[" goes on until "]]", otherwise just to the end of line */
+                lvl = -1;
+                if(!(n = lua_minbracket(tok, i, 3, '[', &lvl))) { m->pend |= 1; continue; }
+                st = 2; k = 3 + n;
+            }
+        }
+        for(; t[k]; k++) {
+            if(skip) { skip--; continue; }
+            /* inside a long string or comment */
+            if(st) {
+                if(t[k] != ']' || !(n = lua_minbracket(tok, i, k, ']', &lvl))) {
+                    if(st == 1) lua_minput(m, t[k], 0);
+                    continue;
+                }
+                if(st == 1) {
+                    lua_minput(m, ']', 0);
+                    for(l = 0; l < lvl; l++) lua_minput(m, '=', 0);
+                    lua_minput(m, ']', 0);
+                    ppc = pc; pc = ']';
+                } else
+                    m->pend |= 1;
+                st = 0; skip = n - 1;
+                /* the tokenizer doesn't know about long brackets, so if it ended inside a string or comment token, then
+                 * we can't tell what comes after it, unless it's whitespace or another comment */
+                if(t[0] == TOK_STRING || t[0] == TOK_COMMENT) {
+                    for(k += n; lua_isspace(t[k]); k++);
+                    if(t[k] && (t[0] != TOK_COMMENT || t[k] != '-' || t[k + 1] != '-')) return 0;
+                    m->pend |= 1; skip = 0;
+                    break;
+                }
+                continue;
+            }
+            if(lua_isspace(t[k])) { m->pend |= t[k] == '\n' ? 2 : 1; continue; }
+            /* beginning of a long string */
+            lvl = -1;
+            if(t[k] == '[' && (n = lua_minbracket(tok, i, k, '[', &lvl))) {
+                lua_minput(m, '[', 0);
+                for(l = 0; l < lvl; l++) lua_minput(m, '=', 0);
+                lua_minput(m, '[', 0);
+                st = 1; skip = n - 1; ds = 0;
+                continue;
+            }
+            if(!lua_isword(t[k])) {
+                lua_minput(m, t[k], 0);
+                /* declarations, ds: 1 "local", 2 "local a", 3 "function a", 4 "function a(", 5 "for", 6 "local function" */
+                switch(ds) {
+                    case 2: ds = t[k] == ',' ? 1 : 0; break;
+                    case 3: if(t[k] == '(') ds = 4; break;
+                    case 4: if(t[k] == ')') ds = 0; break;
+                    case 5: if(t[k] == '=') ds = 0; break;
+                    case 1: case 6: ds = 0; break;
+                }
+                ppc = pc; pc = t[k];
+                continue;
+            }
+            /* a whole word, which might have been split into more tokens by the tokenizer */
+            n = lua_minpeek(tok, i, k, word, sizeof(word) - 1, 0);
+            for(l = 0; l < n && lua_isword(word[l]); l++);
+            skip = l - 1;
+            if((word[0] >= '0' && word[0] <= '9') || lua_iskw(word, l)) {
+                for(n = 0; n < l; n++) lua_minput(m, word[n], word[0] <= '9');
+                word[l] = 0;
+                if(!strcmp(word, "local")) ds = 1; else
+                if(!strcmp(word, "function")) ds = ds == 1 ? 6 : 3; else
+                if(!strcmp(word, "for")) ds = 5; else
+                if(ds != 3 && ds != 4) ds = 0;
+                ppc = pc; pc = word[l - 1];
+                continue;
+            }
+            /* "a.b", "a:b()", "::b::" and table constructors "{ b = 1 }" (this also catches "a, b = 1, 2" but that's
+             * only a missed opportunity) */
+            field = (pc == '.' && ppc != '.') || pc == ':';
+            if(!field && (pc == '{' || pc == ',' || pc == ';') && lua_minpeek(tok, i, k + l, word + l, 2, 1) == 2 &&
+              word[l] == '=' && word[l + 1] != '=') field = 1;
+            id = lua_minid(m, word, l);
+            if(!m->dst) {
+                if(field) id->flags |= LUA_MIN_FIELD;
+                else {
+                    id->cnt++;
+                    if(ds == 1 || ds == 4 || ds == 5 || ds == 6) id->flags |= LUA_MIN_LOCAL;
+                }
+            }
+            if(!field && id->nn[0])
+                for(n = 0; id->nn[n]; n++) lua_minput(m, id->nn[n], 0);
+            else
+                for(n = 0; n < l; n++) lua_minput(m, word[n], 0);
+            if(ds == 1 || ds == 6) ds = ds == 1 ? 2 : 3;
+            ppc = pc; pc = word[l - 1];
+        }
+    }
+    return !st;
+}
+
+/**
+ * Compare identifiers by usage, most used first
+ */
+static int lua_mincmp(const void *a, const void *b)
+{
+    lua_minid_t *A = *((lua_minid_t**)a), *B = *((lua_minid_t**)b);
+    return A->cnt != B->cnt ? B->cnt - A->cnt : (A > B) - (A < B);
+}
+
+/**
+ * Generate the g-th short name
+ */
+static void lua_minname(int g, char *nn)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    int i, l, n;
+
+    for(l = 1, n = 52; l < 7 && g >= n; g -= n, n *= 63, l++);
+    nn[0] = chars[g % 52]; g /= 52;
+    for(i = 1; i < l; i++, g /= 63) nn[i] = chars[g % 63];
+    nn[l] = 0;
+}
+
+/**
+ * Minify Lua code in place: strip comments, collapse whitespace, and give short names to locals and the helper lib's
+ * globals. Returns the new length, or -1 if the code was left as-is
+ */
+static int lua_minify(char *dst, int len)
+{
+    tok_t tok;
+    lua_min_t m;
+    lua_minid_t *id, **ren = NULL;
+    int i, l, n, g, ret = -1;
+
+    if(!tok_newc(&tok, lua_getrules(), dst, len)) return -1;
+    memset(&m, 0, sizeof(m));
+    m.tok = &tok;
+    for(m.size = 1024; m.size < 2 * len; m.size <<= 1);
+    if(!(m.ids = (lua_minid_t*)calloc(m.size, sizeof(lua_minid_t))) || !(m.names = (char*)malloc(2 * len + 4096)) ||
+      !(ren = (lua_minid_t**)malloc(m.size * sizeof(lua_minid_t*)))) goto end;
+
+    /* collect the identifiers, which ones are locals and which ones are used as table fields */
+    if(!lua_minemit(&m)) goto end;
+    /* names that must stay as-is, and the helper lib's globals which can be renamed too */
+    for(i = 0; lua_extern[i]; i++)
+        lua_minid(&m, lua_extern[i], strlen(lua_extern[i]))->flags |= LUA_MIN_FIXED;
+    for(i = 0; lua_libpriv[i]; i++)
+        lua_minid(&m, lua_libpriv[i], strlen(lua_libpriv[i]))->flags |= LUA_MIN_LOCAL;
+
+    /* with "_ENV" any variable could be a table field, so no renaming then. Otherwise rename the most used ones first,
+     * to the shortest names that aren't used by the script */
+    if(!lua_minid(&m, "_ENV", 4)->cnt) {
+        for(i = n = 0; i < m.size; i++)
+            if(m.ids[i].cnt && (m.ids[i].flags & (LUA_MIN_LOCAL | LUA_MIN_FIELD | LUA_MIN_FIXED)) == LUA_MIN_LOCAL)
+                ren[n++] = &m.ids[i];
+        qsort(ren, n, sizeof(lua_minid_t*), lua_mincmp);
+        for(i = g = 0; i < n; i++) {
+            for(id = NULL;; g++) {
+                lua_minname(g, ren[i]->nn);
+                if((l = strlen(ren[i]->nn)) >= ren[i]->len) break;
+                id = lua_minid(&m, ren[i]->nn, l);
+                if(!id->cnt && !(id->flags & LUA_MIN_FIXED) && !lua_iskw(ren[i]->nn, l)) break;
+            }
+            /* keep the name if there's no shorter one left, otherwise reserve the new one */
+            if(l >= ren[i]->len) ren[i]->nn[0] = 0;
+            else { id->cnt = 1; g++; }
+        }
+    }
+
+    /* serialize */
+    m.dst = dst; m.maxlen = len; m.len = m.pend = m.num = m.lc = 0;
+    if(lua_minemit(&m) && m.len <= len) {
+        ret = m.len;
+        dst[ret] = 0;
+    } else
+        tok_tostr(&tok, dst, len + 1);
+end:
+    tok_free(&tok);
+    if(ren) free(ren);
+    if(m.names) free(m.names);
+    if(m.ids) free(m.ids);
+    return ret;
+}
+
+/* hoisted global, "a" or "a.b" */
+typedef struct {
+    char *str;
+    int len;
+    int cnt[2];     /* reads in the helper lib and in the cart's code */
+    char flags;     /* LUA_HST_* bits */
+} lua_hstid_t;
+enum { LUA_HST_LIBDEF = 1, LUA_HST_ASSIGN = 2, LUA_HST_DECL = 4, LUA_HST_TOP = 8, LUA_HST_LIB = 16 };
+/* hoister state */
+typedef struct {
+    lua_hstid_t *ids;   /* identifiers hash table */
+    int size;           /* its size, a power of two, always with plenty of free slots */
+    char *names;        /* identifier strings */
+    int nlen;
+    int locals;         /* number of locals declared in the main chunk */
+    int mark;           /* where the cart's code starts, after the helper lib */
+    char *top, *lib;    /* alias declarations, inserted at the beginning and at mark */
+} lua_hst_t;
+#define LUA_HOISTMAX 64     /* at most this many aliases, so that functions don't run out of upvalues either */
+/* library tables whose functions are hoisted as "a.b" */
+char *lua_hststd[] = { "math", "string", "table", NULL };
+/* if any of these is used, then globals might be accessed as table fields, so nothing is hoisted */
+char *lua_hstenv[] = { "_ENV", "_G", "rawset", "load", NULL };
+
+/**
+ * Find an identifier in the hoister's hash table, adds it if add is set, otherwise returns NULL if it's not there
+ */
+static lua_hstid_t *lua_hstid(lua_hst_t *h, char *s, int l, int add)
+{
+    int j;
+
+    for(j = lua_hash(s, l) & (h->size - 1); h->ids[j].str; j = (j + 1) & (h->size - 1))
+        if(h->ids[j].len == l && !memcmp(h->ids[j].str, s, l)) return &h->ids[j];
+    if(!add) return NULL;
+    h->ids[j].str = h->names + h->nlen; h->ids[j].len = l;
+    memcpy(h->names + h->nlen, s, l);
+    h->names[h->nlen + l] = 0;
+    h->nlen += l + 1;
+    return &h->ids[j];
+}
+
+/**
+ * Scan the code, if dst is NULL then collect how the globals are used, otherwise copy it to dst with the hoisted ones
+ * replaced by their aliases. Returns the length, or -1 if the code can't be parsed
+ */
+static int lua_hstscan(lua_hst_t *h, char *src, int len, char *dst)
+{
+    lua_hstid_t *id;
+    int i, j, k, l, e, o = 0, lvl, depth = 0, blk = 0, ds = 0, gt = 0, top = 0, lib = !h->mark;
+    char c, pc = 0, ppc = 0;
+
+#define lua_hstput(s, n) do { if(dst) memcpy(dst + o, (s), (n)); o += (n); } while(0)
+    for(i = 0; i < len;) {
+        /* the alias declarations go at the beginning (after the header comments) and where the cart's code starts */
+        if(dst && !top && !lua_isspace(src[i]) && (src[i] != '-' || src[i + 1] != '-' || src[i + 2] == '[')) {
+            top = 1; l = strlen(h->top); lua_hstput(h->top, l);
+        }
+        if(dst && !lib && i >= h->mark) {
+            lib = 1; l = strlen(h->lib); lua_hstput(h->lib, l);
+        }
+        c = src[i];
+        /* strings */
+        if(c == '\"' || c == '\'') {
+            for(j = i + 1; j < len && src[j] != c && src[j] != '\n'; j++)
+                if(src[j] == '\\' && j + 1 < len) j++;
+            if(j >= len || src[j] != c) return -1;
+            lua_hstput(src + i, j + 1 - i);
+            i = j + 1; ppc = pc; pc = c; ds = 0;
+            continue;
+        }
+        /* long strings "[[", long comments "--[[" and comments */
+        if(c == '[' || (c == '-' && src[i + 1] == '-')) {
+            k = c == '-' ? i + 2 : i; lvl = -1; j = 0;
+            if(src[k] == '[') {
+                for(l = k + 1; src[l] == '='; l++);
+                if(src[l] == '[') lvl = l - k - 1;
+            }
+            if(lvl >= 0) {
+                for(j = l + 1, l = 0; !l && j < len; j++)
+                    if(src[j] == ']') {
+                        for(e = 1; e <= lvl && src[j + e] == '='; e++);
+                        if(e > lvl && src[j + e] == ']') { j += e; l = 1; }
+                    }
+                if(!l) return -1;
+            } else
+            if(c == '-')
+                for(j = i; j < len && src[j] != '\n'; j++);
+            if(j) {
+                lua_hstput(src + i, j - i);
+                i = j;
+                if(c == '[') { ppc = pc; pc = ']'; ds = 0; }
+                continue;
+            }
+        }
+        if(!lua_isword(c)) {
+            lua_hstput(&c, 1);
+            i++;
+            if(lua_isspace(c)) continue;
+            if(c == '(' || c == '[' || c == '{') depth++;
+            if(c == ')' || c == ']' || c == '}') depth--;
+            /* declarations, ds: 1 "local", 2 "local a", 3 "function a", 4 "function a(", 5 "for", 6 "local function" */
+            switch(ds) {
+                case 2: ds = c == ',' ? 1 : 0; break;
+                case 3: if(c == '(') ds = 4; break;
+                case 4: if(c == ')') ds = 0; break;
+                case 5: if(c == '=') ds = 0; break;
+                case 1: case 6: ds = 0; break;
+            }
+            ppc = pc; pc = c;
+            continue;
+        }
+        for(l = i; l < len && lua_isword(src[l]); l++);
+        /* numbers and keywords */
+        if((c >= '0' && c <= '9') || lua_iskw(src + i, l - i)) {
+            lua_hstput(src + i, l - i);
+            e = l - i;
+            if(e == 5 && !memcmp(src + i, "local", 5)) ds = 1; else
+            if(e == 8 && !memcmp(src + i, "function", 8)) { ds = ds == 1 ? 6 : 3; blk++; } else
+            if(e == 3 && !memcmp(src + i, "for", 3)) ds = 5; else {
+                if(ds != 3 && ds != 4) ds = 0;
+                if((e == 2 && (!memcmp(src + i, "if", 2) || !memcmp(src + i, "do", 2))) ||
+                  (e == 6 && !memcmp(src + i, "repeat", 6))) blk++;
+                if((e == 3 && !memcmp(src + i, "end", 3)) || (e == 5 && !memcmp(src + i, "until", 5))) blk--;
+            }
+            i = l; ppc = pc; pc = src[l - 1];
+            continue;
+        }
+        /* "goto" isn't in the tokenizer's keyword list */
+        if(l - i == 4 && !memcmp(src + i, "goto", 4)) {
+            lua_hstput(src + i, 4);
+            i = l; gt = 1;
+            continue;
+        }
+        /* a name, "a.b" if a is a library table */
+        e = l;
+        if(src[l] == '.' && lua_isword(src[l + 1]) && (src[l + 1] < '0' || src[l + 1] > '9'))
+            for(k = 0; lua_hststd[k]; k++)
+                if((int)strlen(lua_hststd[k]) == l - i && !memcmp(lua_hststd[k], src + i, l - i)) {
+                    for(e = l + 1; e < len && lua_isword(src[e]); e++);
+                    break;
+                }
+        for(k = e; k < len && lua_isspace(src[k]); k++);
+        id = lua_hstid(h, src + i, e - i, !dst);
+        if((pc == '.' && ppc != '.') || pc == ':') {
+            /* table field, not a global */
+        } else
+        if(gt || ((pc == '{' || pc == ',' || pc == ';') && src[k] == '=' && src[k + 1] != '=') ||
+          (src[k] == ',' && !depth && !ds)) {
+            /* goto label, table constructor key or maybe a multiple assignment */
+            if(!dst) id->flags |= LUA_HST_ASSIGN;
+        } else
+        if(ds == 1 || ds == 4 || ds == 5 || ds == 6) {
+            if(!dst) {
+                id->flags |= LUA_HST_DECL;
+                if(!blk || (ds == 6 && blk == 1)) h->locals++;
+            }
+        } else
+        if((ds == 3 && src[k] != '.' && src[k] != ':') || (src[k] == '=' && src[k + 1] != '=')) {
+            /* a definition in the helper lib on the main chunk's level (the "function" keyword already opened a block),
+             * or any other assignment */
+            if(!dst) id->flags |= i < h->mark && (blk == (ds == 3)) && !(id->flags & LUA_HST_LIBDEF) ?
+                LUA_HST_LIBDEF : LUA_HST_ASSIGN;
+        } else
+        if(!dst) id->cnt[i >= h->mark]++;
+        else
+        if(id->flags & (LUA_HST_TOP | LUA_HST_LIB) && (i >= h->mark || (id->flags & LUA_HST_TOP))) {
+            lua_hstput("__", 2);
+            for(j = i; j < e; j++) lua_hstput(src[j] == '.' ? "_" : src + j, 1);
+            i = e; ppc = pc; pc = src[e - 1];
+            continue;
+        }
+        lua_hstput(src + i, e - i);
+        if(ds == 1 || ds == 6) ds = ds == 1 ? 2 : 3;
+        i = e; ppc = pc; pc = src[e - 1]; gt = 0;
+    }
+#undef lua_hstput
+    if(dst && !top) { l = strlen(h->top); memcpy(dst + o, h->top, l); o += l; }
+    if(dst && !lib) { l = strlen(h->lib); memcpy(dst + o, h->lib, l); o += l; }
+    return o;
+}
+
+/**
+ * Compare hoisted globals by usage, most used first
+ */
+static int lua_hstcmp(const void *a, const void *b)
+{
+    lua_hstid_t *A = *((lua_hstid_t**)a), *B = *((lua_hstid_t**)b);
+    int na = A->flags & LUA_HST_TOP ? A->cnt[0] + A->cnt[1] : A->cnt[1];
+    int nb = B->flags & LUA_HST_TOP ? B->cnt[0] + B->cnt[1] : B->cnt[1];
+    return na != nb ? nb - na : (A > B) - (A < B);
+}
+
+/**
+ * Hoist the globals that are never assigned (like math.floor, peek4) and the helper lib's functions into local aliases,
+ * "local __math_floor=math.floor", and replace them at the call sites. Returns the new length (at most maxlen), or -1
+ * if the code was left as-is
+ */
+static int lua_hoist(char *dst, int len, int maxlen)
+{
+    lua_hst_t h;
+    lua_hstid_t *id, *base, **sel = NULL;
+    char *c, *out = NULL, tmp[80];
+    int i, j, k, l, e, n, max, ret = -1;
+
+    memset(&h, 0, sizeof(h));
+    for(h.size = 1024; h.size < 2 * len; h.size <<= 1);
+    if(!(h.ids = (lua_hstid_t*)calloc(h.size, sizeof(lua_hstid_t))) || !(h.names = (char*)malloc(2 * len + 64)) ||
+      !(sel = (lua_hstid_t**)malloc(h.size * sizeof(lua_hstid_t*)))) goto end;
+    h.mark = (c = strstr(dst, "-- Add pico-8 cart below!\n")) ? (int)(c - dst) + 26 : 0;
+    if(lua_hstscan(&h, dst, len, NULL) < 0) goto end;
+    for(i = 0; lua_hstenv[i]; i++)
+        if(lua_hstid(&h, lua_hstenv[i], strlen(lua_hstenv[i]), 0)) goto end;
+
+    /* select the ones that can be hoisted, and won't collide with another name */
+    for(i = n = 0; i < h.size; i++) {
+        id = &h.ids[i];
+        if(!id->str || id->flags & (LUA_HST_ASSIGN | LUA_HST_DECL) || id->len + 2 >= (int)sizeof(tmp) ||
+          !strcmp(id->str, "self") || !strcmp(id->str, "arg")) continue;
+        if((c = strchr(id->str, '.')) && (base = lua_hstid(&h, id->str, c - id->str, 0)) &&
+          base->flags & (LUA_HST_ASSIGN | LUA_HST_DECL | LUA_HST_LIBDEF)) continue;
+        tmp[0] = tmp[1] = '_';
+        for(j = 0; j < id->len; j++) tmp[j + 2] = id->str[j] == '.' ? '_' : id->str[j];
+        if(lua_hstid(&h, tmp, id->len + 2, 0)) continue;
+        if(!(id->flags & LUA_HST_LIBDEF) && id->cnt[0] + id->cnt[1] > 1) { id->flags |= LUA_HST_TOP; sel[n++] = id; } else
+        if(id->flags & LUA_HST_LIBDEF && id->cnt[1] > 1) { id->flags |= LUA_HST_LIB; sel[n++] = id; }
+    }
+    /* the most used ones, as many as the 200 locals limit allows, keeping some for the main chunk's temporaries */
+    max = 200 - 16 - h.locals;
+    if(max > LUA_HOISTMAX) max = LUA_HOISTMAX;
+    if(n < 1 || max < 1) goto end;
+    qsort(sel, n, sizeof(lua_hstid_t*), lua_hstcmp);
+    for(i = max; i < n; i++) sel[i]->flags &= ~(LUA_HST_TOP | LUA_HST_LIB);
+    if(n > max) n = max;
+
+    /* "local __a,__b_c=a,b.c\n", names first, then values */
+    if(!(h.top = (char*)malloc(2 * (n * sizeof(tmp) + 16)))) goto end;
+    h.lib = h.top + n * sizeof(tmp) + 16;
+    for(k = 0; k < 2; k++) {
+        c = k ? h.lib : h.top; *c = 0;
+        for(j = 0; j < 2; j++)
+            for(i = l = 0; i < n; i++)
+                if(sel[i]->flags & (k ? LUA_HST_LIB : LUA_HST_TOP)) {
+                    if(!l++) c += sprintf(c, j ? "=" : "local __"); else c += sprintf(c, j ? "," : ",__");
+                    for(e = 0; e < sel[i]->len; e++) *c++ = !j && sel[i]->str[e] == '.' ? '_' : sel[i]->str[e];
+                }
+        if(c != (k ? h.lib : h.top)) *c++ = '\n';
+        *c = 0;
+    }
+
+    /* every renamed read gets 2 characters longer */
+    for(i = 0, l = len + strlen(h.top) + strlen(h.lib); i < n; i++)
+        l += 2 * (sel[i]->cnt[1] + (sel[i]->flags & LUA_HST_TOP ? sel[i]->cnt[0] : 0));
+    if(l > maxlen || !(out = (char*)malloc(l + 1))) goto end;
+    if((l = lua_hstscan(&h, dst, len, out)) >= 0 && l <= maxlen) {
+        memcpy(dst, out, l);
+        dst[l] = 0;
+        ret = l;
+    }
+end:
+    if(out) free(out);
+    if(h.top) free(h.top);
+    if(sel) free(sel);
+    if(h.names) free(h.names);
+    if(h.ids) free(h.ids);
+    return ret;
+}
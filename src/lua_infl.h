@@ -80,37 +80,46 @@ int decompress_mini(uint8_t *in_p, uint8_t *out_p, int max_len)
 #define BLOCK_LEN_CHAIN_BITS 3
 #define BLOCK_DIST_BITS 5
 #define TINY_LITERAL_BITS 4
-#define PXA_READ_VAL(x)  getval(8)
-static int bit = 1;
-static int byte = 0;
-static int src_pos = 0;
-static uint8_t *src_buf = NULL;
-static int getbit()
+/* bit reader state, kept per call so that multiple carts can be decompressed in parallel. Bits are consumed LSB
+ * first from a 64-bit buffer, which is refilled with as many whole bytes as fit, so most reads are a shift and a mask */
+typedef struct {
+	uint64_t buf;
+	int count;      // number of valid bits in buf
+	int bit_pos;    // number of bits consumed so far
+	int src_pos;    // next byte to be loaded into buf
+	int src_len;
+	uint8_t *src_buf;
+} pxa_ctx_t;
+static inline void refill(pxa_ctx_t *ctx)
 {
-	int ret;
-
-	ret = (src_buf[src_pos] & bit) ? 1 : 0;
-	bit <<= 1;
-	if (bit == 256)
+	while (ctx->count <= 56 && ctx->src_pos < ctx->src_len)
 	{
-		bit = 1;
-		src_pos ++;
+		ctx->buf |= (uint64_t)ctx->src_buf[ctx->src_pos++] << ctx->count;
+		ctx->count += 8;
 	}
-	return ret;
 }
-static int getval(int bits)
+static inline int getval(pxa_ctx_t *ctx, int bits)
 {
-	int i;
-	int val = 0;
-	if (bits == 0) return 0;
+	int val;
 
-	for (i = 0; i < bits; i++)
-		if (getbit())
-			val |= (1 << i);
+	if (ctx->count < bits)
+	{
+		refill(ctx);
+		// past the end of the stream, read zeros
+		if (ctx->count < bits) ctx->count = bits;
+	}
+	val = (int)(ctx->buf & ((1U << bits) - 1));
+	ctx->buf >>= bits;
+	ctx->count -= bits;
+	ctx->bit_pos += bits;
 
 	return val;
 }
-static int getchain(int link_bits, int max_bits)
+static inline int getbit(pxa_ctx_t *ctx)
+{
+	return getval(ctx, 1);
+}
+static int getchain(pxa_ctx_t *ctx, int link_bits, int max_bits)
 {
 	int max_link_val = (1 << link_bits) - 1;
 	int val = 0;
@@ -119,7 +128,7 @@ static int getchain(int link_bits, int max_bits)
 
 	while (vv == max_link_val)
 	{
-		vv = getval(link_bits);
+		vv = getval(ctx, link_bits);
 		bits_read += link_bits;
 		val += vv;
 		if (bits_read >= max_bits) return val; // next val is implicitly 0
@@ -127,7 +136,7 @@ static int getchain(int link_bits, int max_bits)
 
 	return val;
 }
-static int getnum()
+static int getnum(pxa_ctx_t *ctx)
 {
 	int jump = BLOCK_DIST_BITS;
 	int bits = jump;
@@ -136,9 +145,9 @@ static int getnum()
 	// 1  15 bits // more frequent so put first
 	// 01 10 bits
 	// 00  5 bits
-	bits = (3 - getchain(1, 2)) * BLOCK_DIST_BITS;
+	bits = (3 - getchain(ctx, 1, 2)) * BLOCK_DIST_BITS;
 
-	val = getval(bits);
+	val = getval(ctx, bits);
 
 	if (val == 0 && bits == 10)
 		return -1; // raw block marker
@@ -149,36 +158,35 @@ static int getnum()
 int pxa_decompress(uint8_t *in_p, uint8_t *out_p, int max_len)
 {
 	int i;
-	int literal[256];
-	int literal_pos[256];
+	uint8_t literal[256];   // move-to-front table, a byte array so that the shift is a single memmove
 	int dest_pos = 0;
-
-	bit = 1;
-	byte = 0;
-	src_buf = in_p;
-	src_pos = 0;
+	pxa_ctx_t c, *ctx = &c;
 
 	for (i = 0; i < 256; i++)
 		literal[i] = i;
 
-	for (i = 0; i < 256; i++)
-		literal_pos[literal[i]] = i;
-
 	// header
 
 	int header[8];
 	for (i = 0; i < 8; i++)
-		header[i] = PXA_READ_VAL();
+		header[i] = in_p[i];
 
 	int raw_len  = header[4] * 256 + header[5];
 	int comp_len = header[6] * 256 + header[7];
 
+	ctx->buf = 0;
+	ctx->count = 0;
+	ctx->bit_pos = 64;
+	ctx->src_pos = 8;
+	ctx->src_len = comp_len;
+	ctx->src_buf = in_p;
+
 	// printf(" read raw_len:  %d\n", raw_len);
 	// printf(" read comp_len: %d\n", comp_len);
 
-	while (src_pos < comp_len && dest_pos < raw_len && dest_pos < max_len)
+	while ((ctx->bit_pos >> 3) < comp_len && dest_pos < raw_len && dest_pos < max_len)
 	{
-		int block_type = getbit();
+		int block_type = getbit(ctx);
 
 		// printf("%d %d\n", src_pos, block_type); fflush(stdout);
 
@@ -186,14 +194,14 @@ int pxa_decompress(uint8_t *in_p, uint8_t *out_p, int max_len)
 		{
 			// block
 
-			int block_offset = getnum() + 1;
+			int block_offset = getnum(ctx) + 1;
 
 			if (block_offset == 0)
 			{
 				// 0.2.0j: raw block
 				while (dest_pos < raw_len)
 				{
-					out_p[dest_pos] = getval(8);
+					out_p[dest_pos] = getval(ctx, 8);
 					if (out_p[dest_pos] == 0) // found end -- don't advance dest_pos
 						break;
 					dest_pos ++;
@@ -201,7 +209,7 @@ int pxa_decompress(uint8_t *in_p, uint8_t *out_p, int max_len)
 			}
 			else
 			{
-				int block_len = getchain(BLOCK_LEN_CHAIN_BITS, 100000) + PXA_MIN_BLOCK_LEN;
+				int block_len = getchain(ctx, BLOCK_LEN_CHAIN_BITS, 100000) + PXA_MIN_BLOCK_LEN;
 
 				// copy // don't just memcpy because might be copying self for repeating pattern
 				while (block_len > 0){
@@ -222,14 +230,14 @@ int pxa_decompress(uint8_t *in_p, uint8_t *out_p, int max_len)
 			int bits = 0;
 
 			int safety = 0;
-			while (getbit() == 1 && safety++ < 16)
+			while (getbit(ctx) == 1 && safety++ < 16)
 			{
 				lpos += (1 << (TINY_LITERAL_BITS + bits));
 				bits ++;
 			}
 
 			bits += TINY_LITERAL_BITS;
-			lpos += getval(bits);
+			lpos += getval(ctx, bits);
 
 			if (lpos > 255) return 0; // something wrong
 
@@ -240,14 +248,8 @@ int pxa_decompress(uint8_t *in_p, uint8_t *out_p, int max_len)
 			dest_pos++;
 			out_p[dest_pos] = 0;
 
-			int i;
-			for (i = lpos; i > 0; i--)
-			{
-				literal[i] = literal[i-1];
-				literal_pos[literal[i]] ++;
-			}
+			memmove(literal + 1, literal, lpos);
 			literal[0] = c;
-			literal_pos[c] = 0;
 		}
 	}
 
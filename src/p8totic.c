@@ -51,7 +51,18 @@
 
 #include "lua_conv.h"   /* Lua converter and helper lib, PICO-8 wrapper by musurca */
 #include "lua_infl.h"   /* PICO-8 compressed code section inflater by lexaloffle */
+#include "png_infl.h"   /* streaming inflate for the .p8.png image data */
 #define LUAMAX 524288   /* biggest Lua code we can handle */
+#define LUABUF (2 * LUAMAX + lua_libsize() + 1)   /* scratch area needed by p8totic_buf() */
+#define P8_MINIFY 1                                 /* p8totic_buf() flags */
+#define P8_HOIST  2
+
+/* sizes found by p8totic_buf(), in bytes, -1 where not applicable */
+typedef struct {
+    int lib;                /* emitted parts of the helper lib (all of it would be lua_libsize()) */
+    int code;               /* Lua code, including the helper lib */
+    int minified;           /* Lua code after minify */
+} p8stats_t;
 
 /* stuff needed to decrypt/encrypt a TIC-80 png cartridge, from src/ext/png.c (see https://github.com/nesbox/TIC-80) */
 typedef union {
@@ -75,7 +86,99 @@ static inline void bitcpy(uint8_t* dst, uint32_t to, const uint8_t* src, uint32_
 static inline int32_t ceildiv(int32_t a, int32_t b) { return (a + b - 1) / b; }
 /* TIC-80 png stuff end */
 
+/**
+ * Store size bytes in the lower bits of the bytes at dst (as TIC-80 does with its png cartridges), same as calling bitcpy()
+ * for each byte at dst, but with whole words at once when bits per byte is 1, 2, 4 or 8. Like the rest of the code, this
+ * assumes little endian
+ */
+static void bitspread(uint8_t *dst, const uint8_t *src, int size, int bits)
+{
+    uint64_t x, w;
+    uint32_t v;
+    int i = 0, n;
+
+    switch(bits) {
+        case 8: memcpy(dst, src, size); return;
+        case 4:
+            for(; i + 4 <= size; i += 4, dst += 8) {
+                memcpy(&v, src + i, 4); x = v;
+                x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+                x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+                x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+                memcpy(&w, dst, 8); w = (w & ~0x0F0F0F0F0F0F0F0FULL) | x; memcpy(dst, &w, 8);
+            }
+        break;
+        case 2:
+            for(; i + 2 <= size; i += 2, dst += 8) {
+                x = src[i] | (src[i + 1] << 8);
+                x = (x | (x << 24)) & 0x000000FF000000FFULL;
+                x = (x | (x << 12)) & 0x000F000F000F000FULL;
+                x = (x | (x << 6)) & 0x0303030303030303ULL;
+                memcpy(&w, dst, 8); w = (w & ~0x0303030303030303ULL) | x; memcpy(dst, &w, 8);
+            }
+        break;
+        case 1:
+            for(; i < size; i++, dst += 8) {
+                x = src[i];
+                x = (x | (x << 28)) & 0x0000000F0000000FULL;
+                x = (x | (x << 14)) & 0x0003000300030003ULL;
+                x = (x | (x << 7)) & 0x0101010101010101ULL;
+                memcpy(&w, dst, 8); w = (w & ~0x0101010101010101ULL) | x; memcpy(dst, &w, 8);
+            }
+        break;
+        default: break;
+    }
+    /* remaining bytes, or all of them with the odd bits per byte values */
+    for(n = ceildiv(size * BITS_IN_BYTE, bits), i = i * BITS_IN_BYTE / bits; i < n; i++, dst++)
+        bitcpy(dst, 0, src, i * bits, bits);
+}
+
+/**
+ * The other way around, load size bytes from the lower bits of the bytes at src
+ */
+static void bitgather(uint8_t *dst, const uint8_t *src, int size, int bits)
+{
+    uint64_t x;
+    uint32_t v;
+    int i = 0, n;
+
+    switch(bits) {
+        case 8: memcpy(dst, src, size); return;
+        case 4:
+            for(; i + 4 <= size; i += 4, src += 8) {
+                memcpy(&x, src, 8);
+                x &= 0x0F0F0F0F0F0F0F0FULL;
+                x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+                x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+                v = (uint32_t)(x | (x >> 16)); memcpy(dst + i, &v, 4);
+            }
+        break;
+        case 2:
+            for(; i + 2 <= size; i += 2, src += 8) {
+                memcpy(&x, src, 8);
+                x &= 0x0303030303030303ULL;
+                x = (x | (x >> 6)) & 0x000F000F000F000FULL;
+                x = (x | (x >> 12)) & 0x000000FF000000FFULL;
+                x |= x >> 24;
+                dst[i] = x & 0xff; dst[i + 1] = (x >> 8) & 0xff;
+            }
+        break;
+        case 1:
+            /* the multiplication moves bit 0 of byte k to bit 56 + k, without overlapping carries */
+            for(; i < size; i++, src += 8) {
+                memcpy(&x, src, 8);
+                dst[i] = ((x & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+            }
+        break;
+        default: break;
+    }
+    for(n = ceildiv(size * BITS_IN_BYTE, bits), i = i * BITS_IN_BYTE / bits; i < n; i++, src++)
+        bitcpy(dst, i * bits, src, 0, bits);
+}
+
 #define HEX(a) (a>='0' && a<='9' ? a-'0' : (a>='a' && a<='f' ? a-'a'+10 : (a>='A' && a<='F' ? a-'A'+10 : 0)))
+/* end of a section, the next one's header or the end of the file (checked first, so nothing is read past it) */
+#define P8END(b) (!(b)[0] || (b)[0] == '_' || !(b)[1] || (b)[1] == '_')
 #define TICHDR(h,s) do{\
     if(ptr - out + s > maxlen) goto err;\
     *ptr++ = h; n = s; *ptr++ = n & 0xff; *ptr++ = (n >> 8) & 0xff; *ptr++ = (n >> 16) & 0xff;\
@@ -149,9 +252,9 @@ static uint8_t picopal[48] = {
 };
 
 /**
- * Match pico palette and return index
+ * Match pico palette and return index, the slow way
  */
-uint8_t picopal_idx(uint8_t r, uint8_t g, uint8_t b)
+static uint8_t picopal_find(uint8_t r, uint8_t g, uint8_t b)
 {
     uint8_t i, m = 0, dr, dg, db;
     uint32_t d, dm = -1U;
@@ -173,17 +276,236 @@ uint8_t picopal_idx(uint8_t r, uint8_t g, uint8_t b)
     return m;
 }
 
+/* the lower 2 bits don't matter, so each 6-bit RGB has a fixed match. Filled in on first use of each colour (a label only
+ * has a few distinct ones), and it stores index + 1 so that 0 means not known yet. Every thread would store the very same
+ * value, so plain atomic loads and stores are enough */
+static uint8_t picopal_lut[64 * 64 * 64];
+
 /**
- * Public API function to convert cartridges
+ * Match pico palette and return index
  */
-int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
+uint8_t picopal_idx(uint8_t r, uint8_t g, uint8_t b)
+{
+    uint8_t *l = &picopal_lut[((r >> 2) << 12) | ((g >> 2) << 6) | (b >> 2)], i = __atomic_load_n(l, __ATOMIC_RELAXED);
+
+    if(!i) { i = picopal_find(r, g, b) + 1; __atomic_store_n(l, i, __ATOMIC_RELAXED); }
+    return i - 1;
+}
+
+/**
+ * Quantise n RGBA pixels to pico palette indices (one byte each, alpha is ignored)
+ */
+void picopal_quant(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i;
+
+    for(i = 0; i < n; i++, src += 4)
+        dst[i] = picopal_idx(src[0], src[1], src[2]);
+}
+
+/* SIMD kernels for the steganographic byte extraction below, the generic scalar one is always there as a fallback */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define P8PNG_SSE2
+#define P8PNG_AVX2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define P8PNG_NEON
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define P8PNG_SIMD128
+#endif
+
+/**
+ * Extract n bytes hidden in n RGBA pixels, lower 2 bits of the channels are bits 4-5 (R), 2-3 (G), 0-1 (B) and 6-7 (A).
+ * The vectorized kernels take pixels as little endian 32-bit words x, and do ((x << 4) | (x >> 6) | (x >> 16) | (x >> 18))
+ * on x & 0x03030303, which gives the very same byte in the lowest 8 bits, then narrow the words to bytes
+ */
+static void p8png_bits_c(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i;
+    for(i = 0; i < n; i++, src += 4)
+        dst[i] = ((src[0] & 3) << 4) | ((src[1] & 3) << 2) | ((src[2] & 3) << 0) | ((src[3] & 3) << 6);
+}
+
+#ifdef P8PNG_SSE2
+static __m128i p8png_bits_sse2_4(const uint8_t *src)
+{
+    __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i*)src), _mm_set1_epi32(0x03030303));
+    return _mm_and_si128(_mm_or_si128(_mm_or_si128(_mm_slli_epi32(x, 4), _mm_srli_epi32(x, 6)),
+        _mm_or_si128(_mm_srli_epi32(x, 16), _mm_srli_epi32(x, 18))), _mm_set1_epi32(0xff));
+}
+/* 16 pixels per iteration */
+static void p8png_bits_sse2(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i;
+    for(i = 0; i + 16 <= n; i += 16, src += 64)
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(
+            _mm_packs_epi32(p8png_bits_sse2_4(src), p8png_bits_sse2_4(src + 16)),
+            _mm_packs_epi32(p8png_bits_sse2_4(src + 32), p8png_bits_sse2_4(src + 48))));
+    p8png_bits_c(dst + i, src, n - i);
+}
+#endif
+
+#ifdef P8PNG_AVX2
+__attribute__((target("avx2"))) static __m256i p8png_bits_avx2_8(const uint8_t *src)
+{
+    __m256i x = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)src), _mm256_set1_epi32(0x03030303));
+    return _mm256_and_si256(_mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(x, 4), _mm256_srli_epi32(x, 6)),
+        _mm256_or_si256(_mm256_srli_epi32(x, 16), _mm256_srli_epi32(x, 18))), _mm256_set1_epi32(0xff));
+}
+/* 32 pixels per iteration, packing works on 128-bit lanes, so the dwords must be put in order at the end */
+__attribute__((target("avx2"))) static void p8png_bits_avx2(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i;
+    for(i = 0; i + 32 <= n; i += 32, src += 128)
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_permutevar8x32_epi32(_mm256_packus_epi16(
+            _mm256_packs_epi32(p8png_bits_avx2_8(src), p8png_bits_avx2_8(src + 32)),
+            _mm256_packs_epi32(p8png_bits_avx2_8(src + 64), p8png_bits_avx2_8(src + 96))),
+            _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)));
+    p8png_bits_sse2(dst + i, src, n - i);
+}
+#endif
+
+#ifdef P8PNG_NEON
+/* 16 pixels per iteration, here we can simply load the channels deinterleaved */
+static void p8png_bits_neon(uint8_t *dst, const uint8_t *src, int n)
+{
+    uint8x16x4_t p;
+    uint8x16_t m = vdupq_n_u8(3);
+    int i;
+    for(i = 0; i + 16 <= n; i += 16, src += 64) {
+        p = vld4q_u8(src);
+        vst1q_u8(dst + i, vorrq_u8(vorrq_u8(vshlq_n_u8(vandq_u8(p.val[0], m), 4), vshlq_n_u8(vandq_u8(p.val[1], m), 2)),
+            vorrq_u8(vandq_u8(p.val[2], m), vshlq_n_u8(vandq_u8(p.val[3], m), 6))));
+    }
+    p8png_bits_c(dst + i, src, n - i);
+}
+#endif
+
+#ifdef P8PNG_SIMD128
+static v128_t p8png_bits_simd128_4(const uint8_t *src)
+{
+    v128_t x = wasm_v128_and(wasm_v128_load(src), wasm_i32x4_splat(0x03030303));
+    return wasm_v128_and(wasm_v128_or(wasm_v128_or(wasm_i32x4_shl(x, 4), wasm_u32x4_shr(x, 6)),
+        wasm_v128_or(wasm_u32x4_shr(x, 16), wasm_u32x4_shr(x, 18))), wasm_i32x4_splat(0xff));
+}
+/* 16 pixels per iteration, same as the SSE2 one */
+static void p8png_bits_simd128(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i;
+    for(i = 0; i + 16 <= n; i += 16, src += 64)
+        wasm_v128_store(dst + i, wasm_u8x16_narrow_i16x8(
+            wasm_i16x8_narrow_i32x4(p8png_bits_simd128_4(src), p8png_bits_simd128_4(src + 16)),
+            wasm_i16x8_narrow_i32x4(p8png_bits_simd128_4(src + 32), p8png_bits_simd128_4(src + 48))));
+    p8png_bits_c(dst + i, src, n - i);
+}
+#endif
+
+/* the best kernel for this CPU, picked on first use (every thread would pick the same, so no need for a CAS) */
+static void (*p8png_bitsfn)(uint8_t *dst, const uint8_t *src, int n) = NULL;
+static void p8png_bits(uint8_t *dst, const uint8_t *src, int n)
+{
+    void (*fn)(uint8_t *dst, const uint8_t *src, int n) = __atomic_load_n(&p8png_bitsfn, __ATOMIC_RELAXED);
+
+    if(!fn) {
+        fn = p8png_bits_c;
+#if defined(P8PNG_AVX2)
+        fn = __builtin_cpu_supports("avx2") ? p8png_bits_avx2 : p8png_bits_sse2;
+#elif defined(P8PNG_SSE2)
+        fn = p8png_bits_sse2;
+#elif defined(P8PNG_NEON)
+        fn = p8png_bits_neon;
+#elif defined(P8PNG_SIMD128)
+        fn = p8png_bits_simd128;
+#endif
+        __atomic_store_n(&p8png_bitsfn, fn, __ATOMIC_RELAXED);
+    }
+    fn(dst, src, n);
+}
+
+#define P8PNG_W 160
+#define P8PNG_H 205
+
+/**
+ * Decode a .p8.png cartridge row by row: every scanline is inflated, unfiltered, and its steganographic bytes go to the
+ * cart image right away, just like the label area to lbl (both allocated here). Only the inflate window and two rows
+ * are kept, there's no RGBA image. Returns 1 on success, 0 if the png isn't a 160 x 205, 8-bit RGBA, non-interlaced
+ * image (leave those to stb_image), -1 on error
+ */
+static int p8png_decode(const uint8_t *buf, int size, uint8_t **raw, uint8_t **lbl)
+{
+    pnginfl_t *z;
+    uint8_t rows[2][P8PNG_W * 4 + 1], q[128], *row, *up;
+    int i, j, a, b, c, p, pa, pb, pc;
+
+    *raw = *lbl = NULL;
+    /* IHDR must be the first chunk */
+    if(size < 33 || memcmp(buf, "\x89PNG\r\n\x1a\n\0\0\0\x0dIHDR\0\0\0\xa0\0\0\0\xcd\x08\x06\0\0\0", 29)) return 0;
+    if(!(z = (pnginfl_t*)malloc(sizeof(pnginfl_t)))) return -1;
+    /* the cart image is 0x8000 bytes, plus the rest of the last row */
+    if(!pnginfl_init(z, buf, size) || !(*raw = (uint8_t*)malloc(P8PNG_W * P8PNG_H)) || !(*lbl = (uint8_t*)malloc(16320)))
+        goto err;
+    /* screen size is 240 x 136 x 4 bit */
+    memset(*lbl, 0, 16320);
+    /* the row above the first one is all zeros */
+    memset(rows[1], 0, sizeof(rows[1]));
+    for(j = 0; j < P8PNG_H; j++) {
+        row = rows[j & 1] + 1; up = rows[(j & 1) ^ 1] + 1;
+        if(pnginfl_read(z, row - 1, P8PNG_W * 4 + 1) != P8PNG_W * 4 + 1) goto err;
+        /* undo the filter, see https://www.w3.org/TR/png/#9Filter-types, 4 bytes per pixel */
+        switch(row[-1]) {
+            case 0: break;
+            case 1: for(i = 4; i < P8PNG_W * 4; i++) { row[i] += row[i - 4]; } break;
+            case 2: for(i = 0; i < P8PNG_W * 4; i++) { row[i] += up[i]; } break;
+            case 3:
+                for(i = 0; i < 4; i++) row[i] += up[i] >> 1;
+                for(; i < P8PNG_W * 4; i++) row[i] += (row[i - 4] + up[i]) >> 1;
+            break;
+            case 4:
+                /* no pixel on the left, so the predictor is always the one above */
+                for(i = 0; i < 4; i++) row[i] += up[i];
+                for(; i < P8PNG_W * 4; i++) {
+                    a = row[i - 4]; b = up[i]; c = up[i - 4];
+                    p = a + b - c; pa = abs(p - a); pb = abs(p - b); pc = abs(p - c);
+                    row[i] += pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+                }
+            break;
+            default: goto err;
+        }
+        /* cartridge data */
+        p8png_bits(*raw + j * P8PNG_W, row, P8PNG_W);
+        /* the 128 x 128 label area at (16,24), see the stb_image based decoder in p8totic_buf() */
+        if(j >= 24 && j < 152) {
+            picopal_quant(q, row + 16 * 4, 128);
+            for(i = 0; i < 64; i++)
+                (*lbl)[(j - 20) * 120 + 28 + i] = (q[i * 2 + 1] << 4) | q[i * 2];
+        }
+    }
+    free(z);
+    return 1;
+err:
+    if(*lbl) { free(*lbl); *lbl = NULL; }
+    if(*raw) { free(*raw); *raw = NULL; }
+    free(z);
+    return -1;
+}
+
+/**
+ * Convert cartridges, with an optional, caller provided, LUABUF sized scratch area (so that it can be reused), and
+ * optionally alias globals to locals (P8_HOIST) and minify (P8_MINIFY) the Lua code. If stats isn't NULL, it receives the
+ * code sizes
+ */
+int p8totic_buf(uint8_t *buf, int size, uint8_t *out, int maxlen, uint8_t *luabuf, int flags, p8stats_t *stats)
 {
     Header header;
     int w = 0, h = 0, f, i, j, d, s, e, n;
     uint8_t *ptr, *pixels = NULL, *raw = NULL, *lua = NULL, *lu2 = NULL, *lbl = NULL;
     uint8_t *gfx = NULL, *gff = NULL, *map = NULL, *mus = NULL, *snd = NULL, *S, *D;
+    uint8_t wave[256], row[128];
     uint16_t *sn, *dn;
 
+    if(stats) stats->lib = stats->code = stats->minified = -1;
     if(!buf || size < 1 || !out || maxlen < LUAMAX) return 0;
     memset(out, 0, maxlen);
 
@@ -201,15 +523,13 @@ int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
                 for(buf += 7; *buf == '\r' || *buf == '\n'; buf++);
                 for(ptr = buf; *ptr && memcmp(ptr - 1, "\n__", 3); ptr++);
                 if(!lua) {
-                    i = strlen(p8totic_lua);
-                    lua = (uint8_t*)malloc(LUAMAX + i + 1);
+                    i = lua_libsize();
+                    lua = luabuf ? luabuf : (uint8_t*)malloc(LUAMAX + i + 1);
                     if(!lua) goto err;
                     j = *ptr; *ptr = 0;
                     /* no need for pico_lua_to_utf8(), this is already utf-8 */
-                    /* add the Lua helper library */
-                    memcpy(lua, p8totic_lua, i);
-                    /* add the converted Lua code */
-                    pico_lua_to_tic_lua((char*)lua + i, LUAMAX, (char*)buf, ptr - buf);
+                    /* add the used parts of the Lua helper library and the converted Lua code */
+                    pico_lua_to_tic_lua((char*)lua, LUAMAX + i, (char*)buf, ptr - buf, stats ? &stats->lib : NULL);
                     *ptr = j;
                 }
                 buf = ptr;
@@ -225,7 +545,7 @@ int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
                     /* one large 128 x 128 x 4 bit sheet, with 8 x 8 pixel sprites */
                     for(i = 0; i < 8192 && *buf && *buf != '_';) {
                         while(*buf == '\r' || *buf == '\n') buf++;
-                        if(*buf == '_' || buf[1] == '_') break;
+                        if(P8END(buf)) break;
                         /* we just load them here, we convert later when TIC-80 chunk generated
                          * this is little endian! */
                         gfx[i++] = HEX(buf[0]) | (HEX(buf[1]) << 4);
@@ -245,7 +565,7 @@ int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
                     memset(gff, 0, 256);
                     for(i = 0; i < 256 && *buf && *buf != '_';) {
                         while(*buf == '\r' || *buf == '\n') buf++;
-                        if(*buf == '_' || buf[1] == '_') break;
+                        if(P8END(buf)) break;
                         gff[i++] = (HEX(buf[0]) << 4) | HEX(buf[1]);
                         buf += 2;
                     }
@@ -264,7 +584,7 @@ int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
                     for(j = 0; j < 128 && *buf && *buf != '_';)
                         for(i = 0; i < 64 && *buf && *buf != '_';) {
                             while(*buf == '\r' || *buf == '\n') buf++;
-                            if(*buf == '_' || buf[1] == '_') break;
+                            if(P8END(buf)) break;
                             /* this might also encode g .. v, but we can't store that. Also, little endian */
                             lbl[(j + 4) * 120 + 28 + i] = HEX(buf[0]) | (HEX(buf[1]) << 4);
                             buf += 2;
@@ -281,7 +601,7 @@ int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
                     memset(map, 0, 8192);
                     for(i = 0; i < 4096 && *buf && *buf != '_';) {
                         while(*buf == '\r' || *buf == '\n') buf++;
-                        if(*buf == '_' || buf[1] == '_') break;
+                        if(P8END(buf)) break;
                         /* 8 bit per map entry, each a sprite id, big endian */
                         map[i++] = (HEX(buf[0]) << 4) | HEX(buf[1]);
                         buf += 2;
@@ -300,12 +620,12 @@ int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
                     memset(mus, 0, 256);
                     for(i = 0; i < 256 && *buf && *buf != '_';) {
                         while(*buf == '\r' || *buf == '\n') buf++;
-                        if(*buf == '_' || buf[1] == '_') break;
+                        if(P8END(buf)) break;
                         /* flags. These are loaded in MSB in memory */
                         f = (HEX(buf[0]) << 4) | HEX(buf[1]);
                         for(buf += 2; *buf == ' '; buf++);
                         for(j = 0; j < 4; j++) {
-                            if(*buf == '_' || buf[1] == '_') break;
+                            if(P8END(buf)) break;
                             /* big endian data and the MSB flags */
                             mus[i++] = ((HEX(buf[0]) & 7) << 4) | HEX(buf[1]) | (((f >> j) & 1) << 7);
                             buf += 2;
@@ -323,13 +643,13 @@ int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
                     memset(snd, 0, 4352);
                     for(i = 0; i < 4352 && *buf && *buf != '_';) {
                         while(*buf == '\r' || *buf == '\n') buf++;
-                        if(*buf == '_' || buf[1] == '_') break;
-                        f = (HEX(buf[0]) << 4) | HEX(buf[1]); buf += 2; if(*buf == '_' || buf[1] == '_') break;
-                        d = (HEX(buf[0]) << 4) | HEX(buf[1]); buf += 2; if(*buf == '_' || buf[1] == '_') break;
-                        s = (HEX(buf[0]) << 4) | HEX(buf[1]); buf += 2; if(*buf == '_' || buf[1] == '_') break;
+                        if(P8END(buf)) break;
+                        f = (HEX(buf[0]) << 4) | HEX(buf[1]); buf += 2; if(P8END(buf)) break;
+                        d = (HEX(buf[0]) << 4) | HEX(buf[1]); buf += 2; if(P8END(buf)) break;
+                        s = (HEX(buf[0]) << 4) | HEX(buf[1]); buf += 2; if(P8END(buf)) break;
                         e = (HEX(buf[0]) << 4) | HEX(buf[1]); buf += 2;
                         for(j = 0; j < 32; j++) {
-                            if(*buf == '_' || buf[1] == '_' || buf[2] == '_' || buf[3] == '_' || buf[4] == '_') break;
+                            if(P8END(buf) || P8END(buf + 2) || !buf[4] || buf[4] == '_') break;
                             /* tetrad 0..1: pitch, tetrad 2: waveform, tetrad 3: volume, tetrad 4: effect */
                             *((uint16_t*)&snd[i]) =
                                 ((HEX(buf[1]) << 4) | (HEX(buf[0]) & 0x3f)) |   /* pitch 0..63 */
@@ -354,7 +674,8 @@ int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
             while(*buf && *buf != '_') buf++;
         }
     } else
-    if(!memcmp(buf, "\x89PNG", 4) && (pixels = stbi_load_from_memory((const stbi_uc*)buf, size, &w, &h, &f, 4)) && w > 0 && h > 0) {
+    if(!memcmp(buf, "\x89PNG", 4) && ((f = p8png_decode(buf, size, &raw, &lbl)) > 0 ||
+      (!f && (pixels = stbi_load_from_memory((const stbi_uc*)buf, size, &w, &h, &f, 4)) && w > 0 && h > 0))) {
         /*** Ooops, this must be a TIC-80 png cartridge. ***/
         if(w == 256 && h == 256) {
             /* first, let's see if it has a cartridge chunk */
@@ -370,8 +691,7 @@ int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
                 n = header.size + ceildiv(header.size * BITS_IN_BYTE % header.bits, BITS_IN_BYTE);
                 raw = (uint8_t*)malloc(n);
                 if(!raw) goto err;
-                for (i = 0, e = ceildiv(header.size * BITS_IN_BYTE, header.bits); i < e; i++)
-                    bitcpy(raw, i * header.bits, pixels + HEADER_SIZE, i << 3, header.bits);
+                bitgather(raw, pixels + HEADER_SIZE, header.size, header.bits);
 uncomp:         free(pixels);
                 s = 0; ptr = (uint8_t*)stbi_zlib_decode_malloc_guesssize((const char *)raw, n, 8192, &s);
                 if(raw < buf || raw > buf + size) free(raw);
@@ -380,33 +700,30 @@ uncomp:         free(pixels);
             return -1;
         }
         /****** decode binary format ******/
-        if(w != 160 || h != 205) {
-            free(pixels);
-            return -1;
-        }
-        raw = (uint8_t*)malloc(w * h);
-        if(!raw) goto err;
-        for(f = 0; f < w * h; f++)
-            raw[f] = ((pixels[f * 4 + 0] & 3) << 4) | ((pixels[f * 4 + 1] & 3) << 2) |
-                     ((pixels[f * 4 + 2] & 3) << 0) | ((pixels[f * 4 + 3] & 3) << 6);
+        /* usually already done by p8png_decode() row by row, this is for the odd encodings it leaves to stb_image */
+        if(!raw) {
+            if(w != P8PNG_W || h != P8PNG_H) {
+                free(pixels);
+                return -1;
+            }
+            raw = (uint8_t*)malloc(w * h);
+            if(!raw) goto err;
+            p8png_bits(raw, pixels, w * h);
 
-        /*** label (cover image) ***/
-        /* screen size is 240 x 136 x 4 bit */
-        lbl = (uint8_t*)malloc(16320);
-        if(!lbl) goto err;
-        memset(lbl, 0, 16320);
-        /* in lack of a saved label, we parse a 128 x 128 area at (16,24) on the png image with true color pixels, where
-         * the screenshot should be on the cartridge's picture, trying to match with pico palette to make it a screen */
-        for(j = 0; j < 128; j++)
-            for(i = 0; i < 64; i++)
-                lbl[(j + 4) * 120 + 28 + i] =
+            /*** label (cover image) ***/
+            /* screen size is 240 x 136 x 4 bit */
+            lbl = (uint8_t*)malloc(16320);
+            if(!lbl) goto err;
+            memset(lbl, 0, 16320);
+            /* in lack of a saved label, we parse a 128 x 128 area at (16,24) on the png image with true color pixels, where
+             * the screenshot should be on the cartridge's picture, trying to match with pico palette to make it a screen */
+            for(j = 0; j < 128; j++) {
+                picopal_quant(row, pixels + ((j + 24) * w + 16) * 4, 128);
+                for(i = 0; i < 64; i++)
                     /* left pixel in lower tetrad */
-                    (picopal_idx(pixels[(j + 24) * w * 4 + (i * 2 + 17) * 4 + 0],
-                                 pixels[(j + 24) * w * 4 + (i * 2 + 17) * 4 + 1],
-                                 pixels[(j + 24) * w * 4 + (i * 2 + 17) * 4 + 2]) << 4) |   /* upper tetrad's pixel */
-                     picopal_idx(pixels[(j + 24) * w * 4 + (i * 2 + 16) * 4 + 0],
-                                 pixels[(j + 24) * w * 4 + (i * 2 + 16) * 4 + 1],
-                                 pixels[(j + 24) * w * 4 + (i * 2 + 16) * 4 + 2]);          /* lower tetrad's pixel */
+                    lbl[(j + 4) * 120 + 28 + i] = (row[i * 2 + 1] << 4) | row[i * 2];
+            }
+        }
 
         /*** sprites ***/
         gfx = (uint8_t*)malloc(8192);
@@ -437,27 +754,26 @@ uncomp:         free(pixels);
         memcpy(snd, raw + 0x3200, 4352);
 
         /*** lua script ***/
-        i = strlen(p8totic_lua);
-        lua = (uint8_t*)malloc(LUAMAX + i + 1);
+        i = lua_libsize();
+        lua = luabuf ? luabuf : (uint8_t*)malloc(LUAMAX + i + 1);
         if(!lua) goto err;
         memset(lua, 0, LUAMAX + i + 1);
-        lu2 = (uint8_t*)malloc(LUAMAX);
+        lu2 = luabuf ? luabuf + LUAMAX + i + 1 : (uint8_t*)malloc(LUAMAX);
         if(!lu2) goto err;
         memset(lu2, 0, LUAMAX);
         pico8_code_section_decompress(raw + 0x4300, lua, LUAMAX);
         if(!lua[0]) {
             fprintf(stderr, "p8totic: unable to decompress Lua\r\n");
-            free(lua); lua = NULL;
+            if(lua != luabuf) free(lua);
+            lua = NULL;
         } else {
             /* convert to utf-8 */
             j = pico_lua_to_utf8(lu2, LUAMAX, lua, strlen((char*)lua));
             memset(lua, 0, LUAMAX + i + 1);
-            /* add the Lua helper library */
-            memcpy(lua, p8totic_lua, i);
-            /* add the inflated, converted Lua code */
-            pico_lua_to_tic_lua((char*)lua + i, LUAMAX, (char*)lu2, j);
+            /* add the used parts of the Lua helper library and the inflated, converted Lua code */
+            pico_lua_to_tic_lua((char*)lua, LUAMAX + i, (char*)lu2, j, stats ? &stats->lib : NULL);
         }
-        free(lu2);
+        if(!luabuf) free(lu2);
         free(raw);
         free(pixels);
     } else
@@ -486,11 +802,13 @@ uncomp:         free(pixels);
 
     /** CHUNK_WAVEFORM, add fixed PICO-8 waveforms, and generate the rest ***/
     TICHDR(10, 256);
-    memcpy(ptr, picowave, 128);
+    /* generate into a local copy, picowave is shared between concurrent calls */
+    memcpy(wave, picowave, 256);
+    memcpy(ptr, wave, 128);
     if(snd) {
         for(i = 0, S = snd; i < 7; i++, S += 68)
-            pico_genwave(picowave + 128 + i * 16, (uint16_t*)S, S[64], S[65], S[66], S[67]);
-        memcpy(ptr + 128, picowave + 128, 128);
+            pico_genwave(wave + 128 + i * 16, (uint16_t*)S, S[64], S[65], S[66], S[67]);
+        memcpy(ptr + 128, wave + 128, 128);
     }
     ptr += n;
 
@@ -581,6 +899,21 @@ uncomp:         free(pixels);
     /*** CHUNK_CODE, this chunk should be the last in the cartridge ***/
     if(lua) {
         s = strlen((const char*)lua) + 1;
+        if(flags & P8_HOIST) {
+            if((i = lua_hoist((char*)lua, s - 1, LUAMAX + lua_libsize())) < 0)
+                fprintf(stderr, "p8totic: no globals aliased to locals\r\n");
+            else
+                s = i + 1;
+        }
+        if(stats) stats->code = s - 1;
+        if(flags & P8_MINIFY) {
+            if((i = lua_minify((char*)lua, s - 1)) < 0)
+                fprintf(stderr, "p8totic: unable to minify Lua, kept as-is\r\n");
+            else {
+                if(stats) stats->minified = i;
+                s = i + 1;
+            }
+        }
         i = 0; j = s / 65535;
         /* write out into 64k banks */
         while(s > 65535) {
@@ -599,13 +932,13 @@ uncomp:         free(pixels);
             memcpy(ptr, lua + i * 65535, n);
             ptr += n;
         }
-        free(lua);
+        if(lua != luabuf) free(lua);
     }
 
     return ptr - out;
 err:
     if(lbl) free(lbl);
-    if(lua) free(lua);
+    if(lua && lua != luabuf) free(lua);
     if(gfx) free(gfx);
     if(gff) free(gff);
     if(map) free(map);
@@ -616,6 +949,14 @@ err:
     return 0;
 }
 
+/**
+ * Public API function to convert cartridges
+ */
+int p8totic(uint8_t *buf, int size, uint8_t *out, int maxlen)
+{
+    return p8totic_buf(buf, size, out, maxlen, NULL, 0, NULL);
+}
+
 /* things needed for creating a PNG cartridge */
 const stbi_uc cartpng[] = {
 #include "cart.png.dat"
@@ -626,19 +967,68 @@ static uint8_t cartfnt[] = {
 static uint8_t Sweetie16[] = { 0x1a, 0x1c, 0x2c, 0x5d, 0x27, 0x5d, 0xb1, 0x3e, 0x53, 0xef, 0x7d, 0x57, 0xff, 0xcd, 0x75, 0xa7, 0xf0,
  0x70, 0x38, 0xb7, 0x64, 0x25, 0x71, 0x79, 0x29, 0x36, 0x6f, 0x3b, 0x5d, 0xc9, 0x41, 0xa6, 0xf6, 0x73, 0xef, 0xf7, 0xf4, 0xf4, 0xf4,
  0x94, 0xb0, 0xc2, 0x56, 0x6c, 0x86, 0x33, 0x3c, 0x57};
+/* the decoded cover image background and the font metrics, both made on first use */
+typedef struct { int w, h; uint8_t *pixels; } cartimg_t;
+static cartimg_t *cartimg = NULL;
+static int8_t *cartmet = NULL;
+
+/**
+ * Returns the cover image background, decodes cart.png on first call (thread safe, the same way as lua_getrules())
+ */
+static cartimg_t *cartimg_get(void)
+{
+    cartimg_t *c = __atomic_load_n(&cartimg, __ATOMIC_ACQUIRE), *expected = NULL;
+    int f;
+
+    if(!c) {
+        if(!(c = (cartimg_t*)malloc(sizeof(cartimg_t)))) return NULL;
+        if(!(c->pixels = stbi_load_from_memory(cartpng, sizeof(cartpng), &c->w, &c->h, &f, 4))) { free(c); return NULL; }
+        if(!__atomic_compare_exchange_n(&cartimg, &expected, c, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(c->pixels); free(c);
+            c = expected;
+        }
+    }
+    return c;
+}
+
+/**
+ * Returns the first column and the width of each glyph in pairs, calculated on first call (thread safe)
+ */
+static int8_t *drawtext_metrics(void)
+{
+    int8_t *m = __atomic_load_n(&cartmet, __ATOMIC_ACQUIRE), *expected = NULL;
+    uint8_t *fnt;
+    int c, i, j, s, e;
+
+    if(!m) {
+        if(!(m = (int8_t*)malloc(256))) return NULL;
+        memset(m, 0, 256);
+        for(c = 0; c < (int)sizeof(cartfnt) / 8; c++) {
+            fnt = cartfnt + c * 8;
+            for(i = e = 0, s = 7; i < 8; i++)
+                for(j = 0; j < 8; j++) if(fnt[j] & (1 << i)) { if(i < s) { s = i; } if(i > e) { e = i; } }
+            m[c * 2] = s; m[c * 2 + 1] = e - s + 1;
+        }
+        if(!__atomic_compare_exchange_n(&cartmet, &expected, m, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(m);
+            m = expected;
+        }
+    }
+    return m;
+}
+
 void *memmem(const void *haystack, size_t haystacklen, const void *needle, size_t needlelen);
 void drawtext(uint8_t *dst, int dw, int dh, uint32_t c, int x, int y, int w, uint8_t *str)
 {
-    int i, j, k, p = dw * 4, p2 = 2 * p, s, e;
+    int i, j, k, p = dw * 4, p2 = 2 * p, s;
     uint8_t *fnt, *pix = dst + (y * dw + x) * 4, *row;
+    int8_t *met = drawtext_metrics();
 
-    if(!dst || dw < 1 || dh < 1 || x < 0 || y < 0 || w < 1 || !str) return;
-    for(; *str >= ' ' && *str < 128 && x < w; str++, x += (k + 1) * 2, pix += (k + 1) * 8) {
+    if(!dst || dw < 1 || dh < 1 || x < 0 || y < 0 || w < 1 || !str || !met) return;
+    for(; *str >= ' ' && *str < sizeof(cartfnt) / 8 && x < w; str++, x += (k + 1) * 2, pix += (k + 1) * 8) {
         if(*str == ' ') { k = 3; continue; }
         fnt = cartfnt + *str * 8;
-        for(i = e = 0, s = 7; i < 8; i++)
-            for(j = 0; j < 8; j++) if(fnt[j] & (1 << i)) { if(i < s) { s = i; } if(i > e) { e = i; } }
-        k = e - s + 1;
+        s = met[*str * 2]; k = met[*str * 2 + 1];
         for(j = 0; j < 8; j++, fnt++)
             for(row = pix + j * p2, i = 0; i < k && x + i + i < w; i++, row += 8)
                 if(*fnt & (1 << (s + i))) {
@@ -657,6 +1047,7 @@ int tictopng(uint8_t *buf, int size, uint8_t *out, int maxlen)
     Header header = { 0 };
     int w = 0, h = 0, l = 0, f, i, j, s, n;
     uint8_t *ptr, *comp, *pixels = NULL, *raw = NULL, *pal = Sweetie16, *lbl = NULL, *tit = NULL, *ath = NULL;
+    cartimg_t *img;
 
     if(!buf || size < 1 || !out || maxlen < 1) return 0;
     memset(out, 0, maxlen);
@@ -667,8 +1058,10 @@ int tictopng(uint8_t *buf, int size, uint8_t *out, int maxlen)
     comp = (uint8_t*)realloc(comp, s + HEADER_SIZE);
     if(!comp) return 0;
 
-    /* get the cover image background */
-    pixels = stbi_load_from_memory(cartpng, sizeof(cartpng), &w, &h, &f, 4);
+    /* get the cover image background, a copy of it, as we are going to draw on it */
+    if(!(img = cartimg_get()) || !(pixels = (uint8_t*)malloc(img->w * img->h * 4))) { free(comp); return 0; }
+    w = img->w; h = img->h;
+    memcpy(pixels, img->pixels, w * h * 4);
     header.bits = CLAMP(ceildiv(s * BITS_IN_BYTE, w * h * 4 - HEADER_SIZE), 1, BITS_IN_BYTE); header.size = s;
 
     /* parse the .tic, look for cover image, palette and cartridge labels */
@@ -707,18 +1100,22 @@ int tictopng(uint8_t *buf, int size, uint8_t *out, int maxlen)
     /* do the steganography. This code is (mostly) from png_encode() in TIC-80/src/ext/png.c */
     for (i = 0; i < HEADER_SIZE; i++)
         bitcpy(pixels, i << 3, header.data, i * HEADER_BITS, HEADER_BITS);
-    for(n = ceildiv(header.size * BITS_IN_BYTE, header.bits), i = 0; i < n; i++)
-        bitcpy(pixels + HEADER_SIZE, i << 3, comp, i * header.bits, header.bits);
+    bitspread(pixels + HEADER_SIZE, comp, header.size, header.bits);
 
     /* write out png */
     stbi_write_png_compression_level = 9;
     raw = stbi_write_png_to_mem((unsigned char*)pixels, w * 4, w, h, 4, &f, comp, header.size);
     free(pixels);
+    free(comp);
     if(raw) { if(f > maxlen) { f = maxlen; } memcpy(out, raw, f); free(raw); return f; }
     return 0;
 }
 
 #ifndef __EMSCRIPTEN__
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
 
 /* PICO-8 default waveform generation. */
 #ifdef GENWAVEFORM
@@ -746,85 +1143,738 @@ void print_wave(wavefunc_t wavefunc, char *comment) {
 }
 #endif
 
+static int flags = 0;   /* command line flags, alias globals and minify Lua code */
+
 /**
- * Command line interface
+ * Read in a file into a (reused) zero terminated buffer, returns its size
  */
-int main(int argc, char **argv)
+static size_t readfile(char *fn, uint8_t **buf, size_t *bufsize)
 {
     FILE *f;
-    uint8_t *buf = NULL, *out;
+    uint8_t *tmp;
     size_t size = 0;
-    char *fn = NULL, *c;
 
-    /* parse command line */
-    if(argc < 2) {
-        printf("p8totic by bzt MIT\r\n\r\n%s <p8|p8.png|tic.png|tic input> [tic|tic.png output]\r\n\r\n", argv[0]);
-#ifdef GENWAVEFORM
-        print_wave(wave_sine,     "0 - sine");
-        print_wave(wave_triangle, "1 - triangle");
-        print_wave(wave_sawtooth, "2 - sawtooth");
-        print_wave(wave_square,   "3 - square");
-        print_wave(wave_pulse,    "4 - short square / pulse");
-        print_wave(wave_organ,    "5 - ringing / organ");
-        print_wave(wave_noise,    "6 - noise");
-        print_wave(wave_phaser,   "7 - ringing sine / phaser");
-#endif
-        return 1;
+    f = fopen(fn, "rb");
+    if(f) {
+        fseek(f, 0L, SEEK_END);
+        size = (int)ftell(f);
+        fseek(f, 0L, SEEK_SET);
+        if(size + 1 > *bufsize) {
+            tmp = (uint8_t*)realloc(*buf, size + 1);
+            if(!tmp) { fprintf(stderr, "p8totic: unable to allocate memory\r\n"); fclose(f); return 0; }
+            *buf = tmp; *bufsize = size + 1;
+        }
+        if(fread(*buf, 1, size, f) != size) size = 0;
+        (*buf)[size] = 0;
+        fclose(f);
     }
-    if(argc > 2 && argv[2])
-        fn = argv[2];
-    else {
-        fn = malloc(strlen(argv[1]) + 8);
-        if(!fn) { fprintf(stderr, "p8totic: unable to allocate memory\r\n"); exit(1); }
-        strcpy(fn, argv[1]);
+    return size;
+}
+
+/**
+ * Read in a file, convert it and write out the result. The buffers are reused between calls
+ */
+static int convert(char *in, char *fn, uint8_t **buf, size_t *bufsize, size_t *insize, uint8_t *out, uint8_t *luabuf)
+{
+    FILE *f;
+    size_t size;
+    int n, ret = -1, png = 0;
+    char *c;
+    p8stats_t stats = { -1, -1, -1 };
+
+    if(!fn) {
+        fn = malloc(strlen(in) + 8);
+        if(!fn) { fprintf(stderr, "p8totic: unable to allocate memory\r\n"); return -1; }
+        strcpy(fn, in);
         c = strrchr(fn, '.'); if(c && !strcmp(c, ".png")) *c = 0;
         c = strrchr(fn, '.'); if(c && !strcmp(c, ".p8")) *c = 0;
         c = strrchr(fn, '.'); if(c && !strcmp(c, ".tic")) *c = 0;
         if(!c) c = fn + strlen(fn);
         strcpy(c, ".tic");
+        png = 1;
     }
 
     /* get the image data */
-    f = fopen(argv[1], "rb");
-    if(f) {
-        fseek(f, 0L, SEEK_END);
-        size = (int)ftell(f);
-        fseek(f, 0L, SEEK_SET);
-        buf = (uint8_t*)malloc(size + 1);
-        if(!buf) { fprintf(stderr, "p8totic: unable to allocate memory\r\n"); exit(1); }
-        memset(buf, 0, size + 1);
-        if(fread(buf, 1, size, f) != size) size = 0;
-        fclose(f);
-    }
-    if(!buf || size < 1) {
-        fprintf(stderr, "p8topic: unable to read '%s'\r\n", argv[1]);
-        exit(1);
+    size = readfile(in, buf, bufsize);
+    if(insize) *insize = size;
+    if(!*buf || size < 1) {
+        fprintf(stderr, "p8topic: unable to read '%s'\r\n", in);
+        goto end;
     }
-    out = (uint8_t*)malloc(1024*1024);
-    if(!buf) { fprintf(stderr, "p8totic: unable to allocate memory\r\n"); exit(1); }
 
     /* do the thing */
-    c = strrchr(argv[1], '.');
+    c = strrchr(in, '.');
     if(c && !strcmp(c, ".tic")) {
-        if(fn != argv[2]) strcat(fn, ".png");
-        size = tictopng(buf, size, out, 1024*1024);
+        if(png) strcat(fn, ".png");
+        n = tictopng(*buf, size, out, 1024*1024);
     } else
-        size = p8totic(buf, size, out, 1024*1024);
-    if(size < 1) {
-        fprintf(stderr, "p8topic: unable to generate TIC-80 cartridge\r\n");
-        exit(1);
+        n = p8totic_buf(*buf, size, out, 1024*1024, luabuf, flags, &stats);
+    if(n < 1) {
+        fprintf(stderr, "p8topic: unable to generate TIC-80 cartridge from '%s'\r\n", in);
+        goto end;
     }
     f = fopen(fn, "wb");
     if(f) {
-        fwrite(out, 1, size, f);
+        fwrite(out, 1, n, f);
         fclose(f);
-    } else {
+        ret = n;
+        /* code sizes, with the file name as batch mode reports many carts at once */
+        if(stats.code >= 0) {
+            if(stats.minified >= 0)
+                printf("p8totic: %s: Lua code %d bytes (%d banks), minified %d bytes (%d banks), helper lib %d of %d bytes\r\n",
+                    in, stats.code, ceildiv(stats.code + 1, 65535), stats.minified, ceildiv(stats.minified + 1, 65535),
+                    stats.lib, lua_libsize());
+            else
+                printf("p8totic: %s: Lua code %d bytes (%d banks), helper lib %d of %d bytes\r\n", in, stats.code,
+                    ceildiv(stats.code + 1, 65535), stats.lib, lua_libsize());
+        }
+    } else
         fprintf(stderr, "p8totic: unable to write '%s'.\r\n", fn);
+end:
+    if(png) free(fn);
+    return ret;
+}
+
+/**
+ * Batch mode, convert lots of files in parallel with a work stealing thread pool
+ */
+typedef struct {
+    pthread_t th;
+    pthread_mutex_t lock;
+    int head, tail;         /* this worker's share of the file list, taken from head, stolen from tail */
+    int done;
+    size_t insize, outsize;
+} worker_t;
+static char **files = NULL;
+static int numfiles = 0, numworkers = 0;
+static worker_t *workers = NULL;
+
+static int batch_next(int w)
+{
+    int i, v, idx = -1;
+
+    pthread_mutex_lock(&workers[w].lock);
+    if(workers[w].head < workers[w].tail) idx = workers[w].head++;
+    pthread_mutex_unlock(&workers[w].lock);
+    /* our own queue is empty, steal from the others */
+    for(i = 1; idx < 0 && i < numworkers; i++) {
+        v = (w + i) % numworkers;
+        pthread_mutex_lock(&workers[v].lock);
+        if(workers[v].head < workers[v].tail) idx = --workers[v].tail;
+        pthread_mutex_unlock(&workers[v].lock);
+    }
+    return idx;
+}
+
+static void *batch_worker(void *arg)
+{
+    worker_t *w = (worker_t*)arg;
+    uint8_t *buf = NULL, *out, *luabuf;
+    size_t bufsize = 0, insize;
+    int i, s;
+
+    /* each worker has its own buffers, reused for all the files it converts */
+    out = (uint8_t*)malloc(1024*1024);
+    luabuf = (uint8_t*)malloc(LUABUF);
+    if(out && luabuf) {
+        while((i = batch_next(w - workers)) >= 0)
+            if((s = convert(files[i], NULL, &buf, &bufsize, &insize, out, luabuf)) > 0) {
+                w->insize += insize;
+                w->outsize += s;
+                w->done++;
+            }
+    } else
+        fprintf(stderr, "p8totic: unable to allocate memory\r\n");
+    if(luabuf) free(luabuf);
+    if(out) free(out);
+    if(buf) free(buf);
+    return NULL;
+}
+
+static void batch_add(char *dir, char *fn)
+{
+    char **tmp;
+
+    tmp = (char**)realloc(files, (numfiles + 1) * sizeof(char*));
+    if(!tmp || !(tmp[numfiles] = malloc((dir ? strlen(dir) + 1 : 0) + strlen(fn) + 1))) {
+        fprintf(stderr, "p8totic: unable to allocate memory\r\n");
         exit(1);
     }
-    if(fn != argv[2]) free(fn);
+    files = tmp;
+    if(dir) sprintf(files[numfiles++], "%s/%s", dir, fn);
+    else strcpy(files[numfiles++], fn);
+}
+
+static int batch(int argc, char **argv, int nthreads)
+{
+    struct timespec t0, t1;
+    struct stat st;
+    struct dirent *de;
+    DIR *dir;
+    int i, l, n = 0;
+    size_t insize = 0, outsize = 0;
+    double t;
+
+    /* collect the input files, directories are scanned for PICO-8 cartridges */
+    for(i = 0; i < argc; i++) {
+        if(!stat(argv[i], &st) && S_ISDIR(st.st_mode) && (dir = opendir(argv[i]))) {
+            while((de = readdir(dir))) {
+                l = strlen(de->d_name);
+                if((l > 3 && !strcmp(de->d_name + l - 3, ".p8")) || (l > 7 && !strcmp(de->d_name + l - 7, ".p8.png")))
+                    batch_add(argv[i], de->d_name);
+            }
+            closedir(dir);
+        } else
+            batch_add(NULL, argv[i]);
+    }
+    if(nthreads > numfiles) nthreads = numfiles;
+    if(nthreads < 1) nthreads = 1;
+    workers = (worker_t*)malloc(nthreads * sizeof(worker_t));
+    if(!workers) { fprintf(stderr, "p8totic: unable to allocate memory\r\n"); exit(1); }
+    memset(workers, 0, nthreads * sizeof(worker_t));
+    /* distribute files evenly, workers will steal from each other when they run out */
+    for(i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].head = i * numfiles / nthreads;
+        workers[i].tail = (i + 1) * numfiles / nthreads;
+    }
+    numworkers = nthreads;
+
+    /* do the thing */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < nthreads; i++)
+        if(pthread_create(&workers[i].th, NULL, batch_worker, &workers[i])) {
+            fprintf(stderr, "p8totic: unable to start thread\r\n");
+            exit(1);
+        }
+    for(i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].th, NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+        n += workers[i].done; insize += workers[i].insize; outsize += workers[i].outsize;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1000000000.0;
+    if(t <= 0.0) t = 0.000001;
+    printf("p8totic: converted %d of %d cartridges with %d threads in %.3f sec, %.1f carts/s, %.2f MB/s in, %.2f MB/s out\r\n",
+        n, numfiles, nthreads, t, (double)n / t, (double)insize / t / 1048576.0, (double)outsize / t / 1048576.0);
+
+    for(i = 0; i < numfiles; i++)
+        free(files[i]);
+    free(files);
+    free(workers);
+    return n == numfiles ? 0 : 1;
+}
+
+/**
+ * Micro-benchmarks for the conversion stages, and self checks
+ * To run them, enable this define, then compile and run with `./p8totic -b <p8|p8.png files...>`, or just `make check`
+ */
+/*#define BENCHMARK*/
+#ifdef BENCHMARK
+#define BENCH_ITER 200
+static double bench_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1000000000.0;
+}
+
+/* get the PICO-8 Lua source from a cartridge, returns its length */
+static int bench_getlua(uint8_t *buf, size_t size, uint8_t *lua)
+{
+    uint8_t *pixels, *raw, *ptr;
+    int w, h, f, l = 0;
+
+    if(!memcmp(buf, "pico-8 cartridge", 16)) {
+        if((buf = (uint8_t*)strstr((char*)buf, "__lua__"))) {
+            for(buf += 7; *buf == '\r' || *buf == '\n'; buf++);
+            for(ptr = buf; *ptr && memcmp(ptr - 1, "\n__", 3); ptr++);
+            l = ptr - buf < LUAMAX ? ptr - buf : LUAMAX - 1;
+            memcpy(lua, buf, l);
+            lua[l] = 0;
+        }
+    } else
+    if(!memcmp(buf, "\x89PNG", 4) && (pixels = stbi_load_from_memory(buf, size, &w, &h, &f, 4))) {
+        if(w == 160 && h == 205 && (raw = (uint8_t*)malloc(w * h))) {
+            for(f = 0; f < w * h; f++)
+                raw[f] = ((pixels[f * 4 + 0] & 3) << 4) | ((pixels[f * 4 + 1] & 3) << 2) |
+                         ((pixels[f * 4 + 2] & 3) << 0) | ((pixels[f * 4 + 3] & 3) << 6);
+            memset(lua, 0, LUAMAX);
+            pico8_code_section_decompress(raw + 0x4300, lua, LUAMAX);
+            if((ptr = (uint8_t*)malloc(LUAMAX))) {
+                l = pico_lua_to_utf8(ptr, LUAMAX, lua, strlen((char*)lua));
+                memcpy(lua, ptr, l + 1);
+                free(ptr);
+            }
+            free(raw);
+        }
+        free(pixels);
+    }
+    return l;
+}
+
+/* low-bit extraction kernels, checked against the scalar one with random pixels, lengths and alignments, and their speed.
+ * Returns the number of kernels that gave a different result */
+static int bench_lowbits(void)
+{
+    struct { char *name; void (*fn)(uint8_t *dst, const uint8_t *src, int n); } k[3];
+    uint8_t *src, *ref, *dst;
+    int i, j, n, o, l = 160 * 205, num = 0, bad, ret = 0;
+    double t;
+
+    k[num].name = "scalar"; k[num++].fn = p8png_bits_c;
+#ifdef P8PNG_SSE2
+    k[num].name = "sse2"; k[num++].fn = p8png_bits_sse2;
+#endif
+#ifdef P8PNG_AVX2
+    if(__builtin_cpu_supports("avx2")) { k[num].name = "avx2"; k[num++].fn = p8png_bits_avx2; }
+#endif
+#ifdef P8PNG_NEON
+    k[num].name = "neon"; k[num++].fn = p8png_bits_neon;
+#endif
+#ifdef P8PNG_SIMD128
+    k[num].name = "simd128"; k[num++].fn = p8png_bits_simd128;
+#endif
+    if(!(src = (uint8_t*)malloc(l * 4 + 4 + 2 * (l + 1)))) return 1;
+    ref = src + l * 4 + 4; dst = ref + l + 1;
+    srand(1);
+    for(i = 0; i < l * 4 + 4; i++) src[i] = rand();
+    for(j = 0; j < num; j++) {
+        for(i = bad = 0; i < 1000 && !bad; i++) {
+            n = rand() % (l + 1); o = rand() % 4;
+            src[rand() % (l * 4 + 4)] = rand();
+            memset(ref, 0xAA, l + 1); memset(dst, 0xAA, l + 1);
+            p8png_bits_c(ref, src + o, n);
+            (*k[j].fn)(dst, src + o, n);
+            bad = memcmp(ref, dst, l + 1);
+        }
+        t = bench_time();
+        for(i = 0; i < BENCH_ITER * 10; i++)
+            (*k[j].fn)(dst, src, l);
+        t = bench_time() - t;
+        printf("%-32s low bits      %6d bytes %9.2f MB/s %s\r\n", k[j].name, l * 4,
+            (double)l * 4 * BENCH_ITER * 10 / t / 1048576.0, bad ? "MISMATCH" : "ok");
+        if(bad) ret++;
+    }
+    free(src);
+    return ret;
+}
+
+/* TIC-80 png steganography, bitspread() and bitgather() checked against the bitcpy() loops they replace for every bits per
+ * byte value with random data, sizes and pixels, and the speed of both. Returns the number of mismatches */
+static int bench_steg(void)
+{
+    uint8_t *src, *ref, *dst, *pix, *pxr;
+    int b, i, j, n, s, l = 65536, p = 8 * 65536 + 8, bad, ret = 0;
+    double t[4];
+
+    if(!(src = (uint8_t*)malloc(3 * (l + 1) + 2 * p))) return 1;
+    ref = src + l + 1; dst = ref + l + 1; pix = dst + l + 1; pxr = pix + p;
+    srand(1);
+    for(j = 0; j < 3 * (l + 1) + p; j++) src[j] = rand();
+    for(b = 1; b <= BITS_IN_BYTE; b++) {
+        for(i = bad = 0; i < 100 && !bad; i++) {
+            s = rand() % (l + 1); n = ceildiv(s * BITS_IN_BYTE, b);
+            src[rand() % (l + 1)] = rand(); ref[rand() % (l + 1)] = rand(); pix[rand() % p] = rand();
+            memcpy(dst, ref, l + 1); memcpy(pxr, pix, p);
+            /* encode, only the low bits of the pixels may change */
+            for(j = 0; j < n; j++)
+                bitcpy(pxr, j << 3, src, j * b, b);
+            bitspread(pix, src, s, b);
+            bad = !!memcmp(pix, pxr, p);
+            /* decode */
+            for(j = 0; j < n; j++)
+                bitcpy(ref, j * b, pix, j << 3, b);
+            bitgather(dst, pix, s, b);
+            bad |= !!memcmp(dst, ref, l + 1) << 1;
+        }
+        n = ceildiv(l * BITS_IN_BYTE, b);
+        t[0] = bench_time();
+        for(i = 0; i < BENCH_ITER / 4; i++)
+            for(j = 0; j < n; j++)
+                bitcpy(pix, j << 3, src, j * b, b);
+        t[0] = bench_time() - t[0]; t[1] = bench_time();
+        for(i = 0; i < BENCH_ITER / 4; i++)
+            bitspread(pix, src, l, b);
+        t[1] = bench_time() - t[1]; t[2] = bench_time();
+        for(i = 0; i < BENCH_ITER / 4; i++)
+            for(j = 0; j < n; j++)
+                bitcpy(dst, j * b, pix, j << 3, b);
+        t[2] = bench_time() - t[2]; t[3] = bench_time();
+        for(i = 0; i < BENCH_ITER / 4; i++)
+            bitgather(dst, pix, l, b);
+        t[3] = bench_time() - t[3];
+        for(i = 0; i < 4; i++)
+            t[i] = (double)l * (BENCH_ITER / 4) / t[i] / 1048576.0;
+        printf("%-32s %d bits        %6d bytes %9.2f MB/s %9.2f MB/s bitcpy %s\r\n", "bitspread", b, l, t[1], t[0],
+            bad & 1 ? "MISMATCH" : "ok");
+        printf("%-32s %d bits        %6d bytes %9.2f MB/s %9.2f MB/s bitcpy %s\r\n", "bitgather", b, l, t[3], t[2],
+            bad & 2 ? "MISMATCH" : "ok");
+        ret += (bad & 1) + (bad >> 1);
+    }
+    free(src);
+    return ret;
+}
+
+/* the old .p8.png decoder, stb_image to an RGBA buffer, then separate passes for the cart image and the label */
+static int bench_pngstb(uint8_t *buf, size_t size, uint8_t *raw, uint8_t *lbl)
+{
+    uint8_t *pixels, row[128];
+    int w, h, f, i, j;
+
+    if(!(pixels = stbi_load_from_memory(buf, size, &w, &h, &f, 4))) return 0;
+    if(w == P8PNG_W && h == P8PNG_H) {
+        p8png_bits(raw, pixels, w * h);
+        memset(lbl, 0, 16320);
+        for(j = 0; j < 128; j++) {
+            picopal_quant(row, pixels + ((j + 24) * w + 16) * 4, 128);
+            for(i = 0; i < 64; i++)
+                lbl[(j + 4) * 120 + 28 + i] = (row[i * 2 + 1] << 4) | row[i * 2];
+        }
+    }
+    free(pixels);
+    return w == P8PNG_W && h == P8PNG_H;
+}
+
+/* per-cart .p8.png decode latency, the old decoder versus p8png_decode(), which must give the same cart image and label.
+ * Returns 1 on mismatch */
+static int bench_png(char *fn, uint8_t *buf, size_t size)
+{
+    uint8_t *raw, *lbl, *ref;
+    int i, bad;
+    double t, u;
+
+    if(p8png_decode(buf, size, &raw, &lbl) < 1) return 0;
+    if(!(ref = (uint8_t*)malloc(P8PNG_W * P8PNG_H + 16320))) { free(raw); free(lbl); return 1; }
+    bad = !bench_pngstb(buf, size, ref, ref + P8PNG_W * P8PNG_H) || memcmp(raw, ref, P8PNG_W * P8PNG_H) ||
+        memcmp(lbl, ref + P8PNG_W * P8PNG_H, 16320);
+    free(raw); free(lbl);
+    t = bench_time();
+    for(i = 0; i < BENCH_ITER / 4; i++)
+        bench_pngstb(buf, size, ref, ref + P8PNG_W * P8PNG_H);
+    t = bench_time() - t; u = bench_time();
+    for(i = 0; i < BENCH_ITER / 4; i++)
+        if(p8png_decode(buf, size, &raw, &lbl) > 0) { free(raw); free(lbl); }
+    u = bench_time() - u;
+    printf("%-32s png decode    %6d bytes %9.2f ms %9.2f ms stb_image %s\r\n", fn, (int)size, u * 1000.0 / (BENCH_ITER / 4),
+        t * 1000.0 / (BENCH_ITER / 4), bad ? "MISMATCH" : "ok");
+    free(ref);
+    return bad;
+}
+
+/* PXA code section inflate speed, measured in decompressed Lua bytes */
+static void bench_pxa(char *fn, uint8_t *buf, size_t size)
+{
+    uint8_t *pixels, *raw, *lua;
+    int w, h, f, i, l;
+    double t;
+
+    if(memcmp(buf, "\x89PNG", 4) || !(pixels = stbi_load_from_memory(buf, size, &w, &h, &f, 4))) return;
+    raw = (uint8_t*)malloc(w * h);
+    lua = (uint8_t*)malloc(LUAMAX);
+    if(w == 160 && h == 205 && raw && lua) {
+        for(f = 0; f < w * h; f++)
+            raw[f] = ((pixels[f * 4 + 0] & 3) << 4) | ((pixels[f * 4 + 1] & 3) << 2) |
+                     ((pixels[f * 4 + 2] & 3) << 0) | ((pixels[f * 4 + 3] & 3) << 6);
+        if(is_compressed_format_header(raw + 0x4300) == 2) {
+            t = bench_time();
+            for(i = 0; i < BENCH_ITER; i++)
+                pico8_code_section_decompress(raw + 0x4300, lua, LUAMAX);
+            t = bench_time() - t;
+            l = strlen((char*)lua);
+            printf("%-32s pxa inflate   %6d bytes %9.2f MB/s\r\n", fn, l, (double)l * BENCH_ITER / t / 1048576.0);
+        }
+    }
+    if(lua) free(lua);
+    if(raw) free(raw);
+    free(pixels);
+}
+
+/* Lua tokenizer speed */
+static void bench_tok(char *fn, uint8_t *lua, int l)
+{
+    tok_t tok;
+    int i;
+    double t;
+
+    if(l < 1) return;
+    t = bench_time();
+    for(i = 0; i < BENCH_ITER; i++) {
+        tok_newc(&tok, lua_getrules(), (char*)lua, l);
+        tok_free(&tok);
+    }
+    t = bench_time() - t;
+    printf("%-32s tokenize      %6d bytes %9.2f MB/s\r\n", fn, l, (double)l * BENCH_ITER / t / 1048576.0);
+}
+
+/* PICO-8 to TIC-80 Lua rewrite speed (tokenizer plus all the token edits) */
+static void bench_conv(char *fn, uint8_t *lua, int l)
+{
+    char *dst;
+    int i, n = 0;
+    double t;
+
+    if(l < 1 || !(dst = (char*)malloc(LUAMAX + lua_libsize() + 1))) return;
+    /* the generated worst cases are slow, so stop after about a second */
+    t = bench_time();
+    for(i = 0; i < BENCH_ITER && (i < 10 || bench_time() - t < 1.0); i++)
+        pico_lua_to_tic_lua(dst, LUAMAX + lua_libsize(), (char*)lua, l, &n);
+    t = bench_time() - t;
+    printf("%-32s lua convert   %6d bytes %9.2f ms\r\n", fn, l, t * 1000.0 / i);
+    /* how much of the helper lib was left out */
+    printf("%-32s helper lib    %6d bytes %6d saved\r\n", fn, n, lua_libsize() - n);
+    free(dst);
+}
+
+/* Lua minifier speed and the code size before and after */
+static void bench_min(char *fn, uint8_t *lua, int l)
+{
+    char *src, *dst;
+    int i, n, m = -1;
+    double t;
+
+    if(l < 1 || !(src = (char*)malloc(2 * (LUAMAX + lua_libsize() + 1)))) return;
+    dst = src + LUAMAX + lua_libsize() + 1;
+    n = pico_lua_to_tic_lua(src, LUAMAX + lua_libsize(), (char*)lua, l, NULL);
+    t = bench_time();
+    for(i = 0; i < BENCH_ITER; i++) {
+        memcpy(dst, src, n + 1);
+        m = lua_minify(dst, n);
+    }
+    t = bench_time() - t;
+    printf("%-32s lua minify    %6d bytes %6d minified %9.2f ms\r\n", fn, n, m, t * 1000.0 / BENCH_ITER);
+    free(src);
+}
+
+/* synthetic carts for the worst cases of the token edits, each rewrite inserts tokens in the middle of the list, and
+ * the shl() and shr() rewrites look for the closing bracket of every call. Returns the length of the generated source */
+static int bench_gen(int what, uint8_t *lua)
+{
+    int i, j, l = 0;
+
+    switch(what) {
+        case 0:
+            /* 10k lines of compound assignments */
+            for(i = 0; i < 10000; i++)
+                l += sprintf((char*)lua + l, "a%d += b[%d] * %d\n", i % 100, i % 64, i);
+        break;
+        case 1:
+            /* 100 lines of 300 nested shl() calls */
+            for(i = 0; i < 100; i++) {
+                l += sprintf((char*)lua + l, "a%d = ", i);
+                for(j = 0; j < 300; j++) l += sprintf((char*)lua + l, "shl(");
+                l += sprintf((char*)lua + l, "%d", i);
+                for(j = 0; j < 300; j++) l += sprintf((char*)lua + l, ",1)");
+                l += sprintf((char*)lua + l, "\n");
+            }
+        break;
+        case 2:
+            /* 1500 lines of calls and tables nested 20 deep */
+            for(i = 0; i < 1500; i++) {
+                l += sprintf((char*)lua + l, "a%d = ", i % 100);
+                for(j = 0; j < 20; j++) l += sprintf((char*)lua + l, "f%d({b[%d],", j, j);
+                l += sprintf((char*)lua + l, "%d", i);
+                for(j = 0; j < 20; j++) l += sprintf((char*)lua + l, "})");
+                l += sprintf((char*)lua + l, "\n");
+            }
+        break;
+    }
+    return l;
+}
+
+/* thread safety check, several threads convert all the carts at once with every flag combination (and the results back to
+ * png), over and over. This runs first so that the lazy initializations race too, and the results must match a single
+ * threaded run done afterwards. Returns the number of mismatches */
+#define BENCH_THREADS 8
+#define BENCH_ROUNDS 2
+typedef struct {
+    pthread_t th;
+    int id, bad;
+    uint64_t *sum;          /* checksum for each file and flag combination */
+} bench_thread_t;
+static uint8_t **bench_bufs = NULL;
+static size_t *bench_sizes = NULL;
+static int bench_num = 0;
+
+/* convert the cart to tic and that to tic.png, returns the checksum of both */
+static uint64_t bench_sum(int i, int f, uint8_t *buf, uint8_t *out, uint8_t *luabuf)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int j, n, m = 0;
+
+    /* p8totic_buf() temporarily modifies its input, so each thread needs its own copy */
+    memcpy(buf, bench_bufs[i], bench_sizes[i] + 1);
+    n = p8totic_buf(buf, bench_sizes[i], out, 1024*1024, luabuf, f, NULL);
+    if(n > 0) m = tictopng(out, n, out + 1024*1024, 1024*1024);
+    for(j = 0; j < n; j++) h = (h ^ out[j]) * 1099511628211ULL;
+    for(j = 0; j < m; j++) h = (h ^ out[1024*1024 + j]) * 1099511628211ULL;
+    return (h ^ (uint64_t)n) * 1099511628211ULL ^ (uint64_t)m;
+}
+
+static void *bench_thread(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t*)arg;
+    uint8_t *buf, *out, *luabuf;
+    uint64_t s;
+    size_t l = 0;
+    int i, j, r, n = bench_num * 4;
+
+    for(i = 0; i < bench_num; i++) if(bench_sizes[i] > l) l = bench_sizes[i];
+    buf = (uint8_t*)malloc(l + 1);
+    out = (uint8_t*)malloc(2*1024*1024);
+    luabuf = (uint8_t*)malloc(LUABUF);
+    if(buf && out && luabuf) {
+        for(r = 0; r < BENCH_ROUNDS; r++)
+            for(i = 0; i < n; i++) {
+                /* each thread starts at a different file, low bits are the flags */
+                j = (i + t->id * n / BENCH_THREADS) % n;
+                s = bench_sum(j >> 2, j & 3, buf, out, luabuf);
+                if(!r) t->sum[j] = s; else
+                if(t->sum[j] != s) t->bad++;
+            }
+    } else {
+        fprintf(stderr, "p8totic: unable to allocate memory\r\n");
+        t->bad++;
+    }
+    if(luabuf) free(luabuf);
+    if(out) free(out);
+    if(buf) free(buf);
+    return NULL;
+}
+
+static int bench_threads(int argc, char **argv)
+{
+    bench_thread_t th[BENCH_THREADS];
+    uint8_t *buf, *out, *luabuf;
+    uint64_t s;
+    size_t bufsize, l = 0;
+    int i, j, n, bad = 0;
+    double t;
+
+    bench_bufs = (uint8_t**)malloc(argc * sizeof(uint8_t*));
+    bench_sizes = (size_t*)malloc(argc * sizeof(size_t));
+    if(!bench_bufs || !bench_sizes) return 1;
+    for(i = 0; i < argc; i++) {
+        buf = NULL; bufsize = 0;
+        if((bench_sizes[bench_num] = readfile(argv[i], &buf, &bufsize))) {
+            if(bench_sizes[bench_num] > l) l = bench_sizes[bench_num];
+            bench_bufs[bench_num++] = buf;
+        } else
+        if(buf) free(buf);
+    }
+    n = bench_num * 4;
+    memset(th, 0, sizeof(th));
+    t = bench_time();
+    for(i = 0; i < BENCH_THREADS; i++) {
+        th[i].id = i;
+        if(!(th[i].sum = (uint64_t*)malloc((n ? n : 1) * sizeof(uint64_t))) ||
+          pthread_create(&th[i].th, NULL, bench_thread, &th[i])) {
+            fprintf(stderr, "p8totic: unable to start thread\r\n");
+            exit(1);
+        }
+    }
+    for(i = 0; i < BENCH_THREADS; i++)
+        pthread_join(th[i].th, NULL);
+    t = bench_time() - t;
+    /* compare with a single threaded run */
+    buf = (uint8_t*)malloc(l + 1);
+    out = (uint8_t*)malloc(2*1024*1024);
+    luabuf = (uint8_t*)malloc(LUABUF);
+    if(buf && out && luabuf) {
+        for(j = 0; j < n; j++) {
+            s = bench_sum(j >> 2, j & 3, buf, out, luabuf);
+            for(i = 0; i < BENCH_THREADS; i++)
+                if(th[i].sum[j] != s) bad++;
+        }
+    } else bad++;
+    for(i = 0; i < BENCH_THREADS; i++) { bad += th[i].bad; free(th[i].sum); }
+    printf("%-32s %d threads     %6d carts %9.2f carts/s %s\r\n", "all files", BENCH_THREADS, bench_num,
+        (double)n * BENCH_ROUNDS * BENCH_THREADS / t, bad ? "MISMATCH" : "ok");
+    if(luabuf) free(luabuf);
+    if(out) free(out);
+    if(buf) free(buf);
+    for(i = 0; i < bench_num; i++) free(bench_bufs[i]);
+    free(bench_bufs); free(bench_sizes);
+    return bad;
+}
+
+/* run all the benchmarks, returns the number of failed checks */
+static int benchmark(int argc, char **argv)
+{
+    char *gen[] = { "(generated) 10k lines of +=", "(generated) nested shl()", "(generated) nested tables" };
+    uint8_t *buf = NULL, *lua;
+    size_t bufsize = 0, size;
+    int i, l, bad;
+
+    bad = bench_threads(argc, argv);
+    if(!(lua = (uint8_t*)malloc(LUAMAX))) return bad + 1;
+    bad += bench_lowbits();
+    bad += bench_steg();
+    for(i = 0; i < argc; i++) {
+        if(!(size = readfile(argv[i], &buf, &bufsize))) continue;
+        bad += bench_png(argv[i], buf, size);
+        bench_pxa(argv[i], buf, size);
+        l = bench_getlua(buf, size, lua);
+        bench_tok(argv[i], lua, l);
+        bench_conv(argv[i], lua, l);
+        bench_min(argv[i], lua, l);
+    }
+    for(i = 0; i < 3; i++) {
+        l = bench_gen(i, lua);
+        bench_tok(gen[i], lua, l);
+        bench_conv(gen[i], lua, l);
+    }
+    free(lua);
+    if(buf) free(buf);
+    if(bad) fprintf(stderr, "p8totic: %d checks failed\r\n", bad);
+    return bad;
+}
+#endif
+
+/**
+ * Command line interface
+ */
+int main(int argc, char **argv)
+{
+    uint8_t *buf = NULL, *out;
+    size_t bufsize = 0;
+
+    /* parse command line */
+    while(argc > 1 && (!strcmp(argv[1], "-m") || !strcmp(argv[1], "-l"))) {
+        flags |= argv[1][1] == 'm' ? P8_MINIFY : P8_HOIST;
+        argv[1] = argv[0]; argc--; argv++;
+    }
+    if(argc < 2) {
+        printf("p8totic by bzt MIT\r\n\r\n%s [-m] [-l] <p8|p8.png|tic.png|tic input> [tic|tic.png output]\r\n"
+            "%s [-m] [-l] -j <threads> <inputs or directories...>\r\n\r\n  -m: minify Lua code\r\n"
+            "  -l: alias frequently used globals to locals\r\n\r\n", argv[0], argv[0]);
+#ifdef BENCHMARK
+        printf("%s -b <p8|p8.png files...>\r\n\r\n  -b: run the benchmarks and self checks, exits with 1 if a check fails\r\n\r\n",
+            argv[0]);
+#endif
+#ifdef GENWAVEFORM
+        print_wave(wave_sine,     "0 - sine");
+        print_wave(wave_triangle, "1 - triangle");
+        print_wave(wave_sawtooth, "2 - sawtooth");
+        print_wave(wave_square,   "3 - square");
+        print_wave(wave_pulse,    "4 - short square / pulse");
+        print_wave(wave_organ,    "5 - ringing / organ");
+        print_wave(wave_noise,    "6 - noise");
+        print_wave(wave_phaser,   "7 - ringing sine / phaser");
+#endif
+        return 1;
+    }
+    if(argc > 3 && !strcmp(argv[1], "-j"))
+        return batch(argc - 3, argv + 3, atoi(argv[2]));
+#ifdef BENCHMARK
+    if(argc > 2 && !strcmp(argv[1], "-b")) return benchmark(argc - 2, argv + 2) ? 1 : 0;
+#endif
+
+    out = (uint8_t*)malloc(1024*1024);
+    if(!out) { fprintf(stderr, "p8totic: unable to allocate memory\r\n"); exit(1); }
+    if(convert(argv[1], argc > 2 ? argv[2] : NULL, &buf, &bufsize, NULL, out, NULL) < 1) exit(1);
     free(out);
-    free(buf);
+    if(buf) free(buf);
     return 0;
 }
 #endif
@@ -0,0 +1,321 @@
+/*
+ * png_infl.h
+ *
+ * Copyright (C) 2022 bzt (bztsrc@gitlab) MIT license
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Streaming inflate for the image data of PNG files
+ * https://www.rfc-editor.org/rfc/rfc1951
+ */
+
+#ifndef PNG_INFL_H
+#define PNG_INFL_H
+
+/**
+ * Unlike stb_image's zlib, this one is a state machine that can be stopped after any number of output bytes and
+ * continued later, so the caller can ask for one scanline at a time. It reads the compressed stream straight from the
+ * IDAT chunks of the png in memory (no matter how many chunks it is split into), and only keeps the 32k window
+ */
+#define PNGINFL_FAST 10                 /* bits looked up at once when decoding a symbol */
+#define PNGINFL_WIN  32768
+
+typedef struct {
+    uint16_t fast[1 << PNGINFL_FAST];   /* symbol | length << 9 for the short codes indexed by their bits, 0 if longer */
+    uint16_t count[16];                 /* number of codes of each length */
+    uint16_t sym[288];                  /* symbols in canonical code order */
+} pnginfl_huff_t;
+
+typedef struct {
+    const uint8_t *pos, *end;           /* read position in the current IDAT chunk, end of the png */
+    uint32_t left;                      /* bytes left in the current IDAT chunk */
+    uint64_t bits;                      /* bit buffer, next bit is the lowest */
+    int cnt, pad;                       /* number of bits in the buffer, zero bytes added past the end of the data */
+    int last, type, stored;             /* final block seen, block type (-1 header next, -2 end), stored bytes left */
+    int mlen, mdist;                    /* the part of a match not copied yet */
+    uint32_t wpos;                      /* number of bytes inflated so far */
+    pnginfl_huff_t lit, dist;
+    uint8_t win[PNGINFL_WIN];
+} pnginfl_t;
+
+static const uint16_t pnginfl_lbase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83,
+    99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t pnginfl_lext[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t pnginfl_dbase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t pnginfl_dext[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12,
+    12, 13, 13 };
+
+/* step to the next chunk, returns 0 if it isn't an IDAT (those must be consecutive) */
+static int pnginfl_chunk(pnginfl_t *z)
+{
+    const uint8_t *p = z->pos + 4;      /* skip the CRC of the current chunk */
+    uint32_t n;
+
+    if(z->end - p < 12) return 0;
+    n = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    if(memcmp(p + 4, "IDAT", 4) || n > (uint32_t)(z->end - p - 12)) return 0;
+    z->pos = p + 8; z->left = n;
+    return 1;
+}
+
+/* fill up the bit buffer with whole bytes, with zeros past the end of the data (they are only an error if they are used) */
+static void pnginfl_refill(pnginfl_t *z)
+{
+    while(z->cnt <= 56) {
+        if(!z->left) {
+            if(z->pad || !pnginfl_chunk(z)) { z->pad++; z->cnt += 8; }
+            continue;
+        }
+        z->bits |= (uint64_t)*z->pos++ << z->cnt; z->left--; z->cnt += 8;
+    }
+}
+
+static inline uint32_t pnginfl_bits(pnginfl_t *z, int n)
+{
+    uint32_t v;
+
+    if(z->cnt < n) pnginfl_refill(z);
+    v = (uint32_t)z->bits & ((1U << n) - 1);
+    z->bits >>= n; z->cnt -= n;
+    return v;
+}
+
+/* build the decoding tables from code lengths, returns 0 if there are more codes than fit */
+static int pnginfl_build(pnginfl_huff_t *h, const uint8_t *len, int n)
+{
+    int i, j, l, r, code, left = 1, offs[16], next[16];
+
+    memset(h->count, 0, sizeof(h->count));
+    memset(h->fast, 0, sizeof(h->fast));
+    for(i = 0; i < n; i++) h->count[len[i]]++;
+    h->count[0] = 0;
+    for(l = 1; l < 16; l++) {
+        left = (left << 1) - h->count[l];
+        if(left < 0) return 0;
+    }
+    for(offs[1] = code = 0, l = 1; l < 16; l++) {
+        if(l < 15) offs[l + 1] = offs[l] + h->count[l];
+        next[l] = code; code = (code + h->count[l]) << 1;
+    }
+    for(i = 0; i < n; i++)
+        if((l = len[i])) {
+            h->sym[offs[l]++] = i;
+            code = next[l]++;
+            /* codes are stored from the most significant bit, so the fast table index has them reversed */
+            if(l <= PNGINFL_FAST) {
+                for(j = r = 0; j < l; j++) r |= ((code >> j) & 1) << (l - 1 - j);
+                for(; r < (1 << PNGINFL_FAST); r += 1 << l) h->fast[r] = (l << 9) | i;
+            }
+        }
+    return 1;
+}
+
+/* walk the canonical codes one bit at a time for codes longer than the fast table, returns -1 if the bits aren't a
+ * valid code, otherwise the symbol with its length in *len */
+static int pnginfl_walk(const pnginfl_huff_t *h, uint64_t b, int *len)
+{
+    int l, c, code = 0, first = 0, idx = 0;
+
+    for(l = 1; l < 16; l++, b >>= 1) {
+        code |= b & 1;
+        c = h->count[l];
+        if(code - first < c) { *len = l; return h->sym[idx + code - first]; }
+        idx += c; first = (first + c) << 1; code <<= 1;
+    }
+    return -1;
+}
+
+/* decode a symbol, returns -1 if the bits aren't a valid code */
+static inline int pnginfl_sym(pnginfl_t *z, const pnginfl_huff_t *h)
+{
+    int c, l;
+
+    if(z->cnt < 15) pnginfl_refill(z);
+    if((c = h->fast[z->bits & ((1 << PNGINFL_FAST) - 1)])) { l = c >> 9; c &= 511; }
+    else if((c = pnginfl_walk(h, z->bits, &l)) < 0) return -1;
+    z->bits >>= l; z->cnt -= l;
+    return c;
+}
+
+/* the inner loop of a compressed block, with the state in locals as the stores to dst could alias it. It only runs
+ * while there are 8 bytes left in the chunk, that's enough for a symbol, a length, a distance and their extra bits
+ * (at most 48 bits), so no end of data checks are needed. Returns the new position in dst, or -1 on error */
+static int pnginfl_fast(pnginfl_t *z, uint8_t *dst, int i, int n)
+{
+    const uint8_t *p = z->pos, *e = z->pos + z->left - 8;
+    uint8_t *win = z->win;
+    uint64_t b = z->bits;
+    uint32_t w = z->wpos, m, d;
+    int c = z->cnt, s, l;
+
+    while(i < n && p <= e) {
+        while(c <= 56) { b |= (uint64_t)*p++ << c; c += 8; }
+        if((s = z->lit.fast[b & ((1 << PNGINFL_FAST) - 1)])) { l = s >> 9; s &= 511; }
+        else if((s = pnginfl_walk(&z->lit, b, &l)) < 0) return -1;
+        b >>= l; c -= l;
+        if(s < 256) { dst[i++] = win[w++ & (PNGINFL_WIN - 1)] = s; continue; }
+        if(s == 256) { z->type = -1; break; }
+        if((s -= 257) > 28) return -1;
+        l = pnginfl_lext[s]; m = pnginfl_lbase[s] + ((uint32_t)b & ((1U << l) - 1)); b >>= l; c -= l;
+        if((s = z->dist.fast[b & ((1 << PNGINFL_FAST) - 1)])) { l = s >> 9; s &= 511; }
+        else if((s = pnginfl_walk(&z->dist, b, &l)) < 0) return -1;
+        b >>= l; c -= l;
+        if(s > 29) return -1;
+        l = pnginfl_dext[s]; d = pnginfl_dbase[s] + ((uint32_t)b & ((1U << l) - 1)); b >>= l; c -= l;
+        if(d > w) return -1;
+        /* what doesn't fit in dst is left for the next call */
+        for(; m && i < n; m--, w++)
+            dst[i++] = win[w & (PNGINFL_WIN - 1)] = win[(w - d) & (PNGINFL_WIN - 1)];
+        z->mlen = m; z->mdist = d;
+    }
+    z->left -= p - z->pos; z->pos = p;
+    z->bits = b; z->cnt = c; z->wpos = w;
+    return i;
+}
+
+/* read a block header, returns 0 on error */
+static int pnginfl_block(pnginfl_t *z)
+{
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    uint8_t len[288 + 32], cl[19];
+    int i, n, s, c, nlit, ndist;
+
+    if(z->last) { z->type = -2; return 1; }
+    z->last = pnginfl_bits(z, 1);
+    switch(pnginfl_bits(z, 2)) {
+        case 0:
+            /* stored block, starts at the next byte boundary */
+            pnginfl_bits(z, z->cnt & 7);
+            n = pnginfl_bits(z, 16);
+            if((pnginfl_bits(z, 16) ^ n) != 0xffff) return 0;
+            z->stored = n; z->type = 0;
+        return 1;
+        case 1:
+            /* fixed codes */
+            for(i = 0; i < 288; i++) len[i] = i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8));
+            for(i = 0; i < 30; i++) len[288 + i] = 5;
+            nlit = 288; ndist = 30;
+        break;
+        case 2:
+            /* dynamic codes, the code lengths are compressed too */
+            nlit = pnginfl_bits(z, 5) + 257; ndist = pnginfl_bits(z, 5) + 1; n = pnginfl_bits(z, 4) + 4;
+            memset(cl, 0, sizeof(cl));
+            for(i = 0; i < n; i++) cl[order[i]] = pnginfl_bits(z, 3);
+            if(!pnginfl_build(&z->lit, cl, 19)) return 0;
+            for(i = 0; i < nlit + ndist;) {
+                if((s = pnginfl_sym(z, &z->lit)) < 0) return 0;
+                if(s < 16) { len[i++] = s; continue; }
+                if(s == 16) { if(!i) { return 0; } c = len[i - 1]; n = 3 + pnginfl_bits(z, 2); } else
+                if(s == 17) { c = 0; n = 3 + pnginfl_bits(z, 3); }
+                else { c = 0; n = 11 + pnginfl_bits(z, 7); }
+                if(i + n > nlit + ndist) return 0;
+                memset(len + i, c, n); i += n;
+            }
+            if(!len[256]) return 0;
+        break;
+        default: return 0;
+    }
+    if(!pnginfl_build(&z->lit, len, nlit) || !pnginfl_build(&z->dist, len + nlit, ndist)) return 0;
+    z->type = 1;
+    return 1;
+}
+
+/**
+ * Start inflating the image data of the png at buf, returns 0 if there's no image data or it's not zlib compressed
+ */
+int pnginfl_init(pnginfl_t *z, const uint8_t *buf, int size)
+{
+    const uint8_t *p;
+    uint32_t n = 0, h;
+
+    z->end = buf + size;
+    z->bits = 0; z->cnt = z->pad = 0;
+    z->last = z->stored = z->mlen = z->mdist = 0; z->type = -1;
+    z->wpos = 0;
+    /* skip the signature and the chunks before the first IDAT */
+    for(p = buf + 8; z->end - p >= 12; p += n + 12) {
+        n = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        if(n > (uint32_t)(z->end - p - 12) || !memcmp(p + 4, "IEND", 4)) return 0;
+        if(!memcmp(p + 4, "IDAT", 4)) break;
+    }
+    if(z->end - p < 12) return 0;
+    z->pos = p + 8; z->left = n;
+    /* zlib header, deflate with no preset dictionary */
+    h = pnginfl_bits(z, 16);
+    return (h & 15) == 8 && !(((h & 0xff) << 8 | h >> 8) % 31) && !(h & 0x2000);
+}
+
+/**
+ * Inflate the next n bytes to dst, returns n, less at the end of the stream, or -1 on error
+ */
+int pnginfl_read(pnginfl_t *z, uint8_t *dst, int n)
+{
+    int i = 0, s, d;
+
+    while(i < n) {
+        /* the rest of a match, byte by byte as it might overlap with itself */
+        if(z->mlen) {
+            for(; z->mlen && i < n; z->mlen--, z->wpos++)
+                dst[i++] = z->win[z->wpos & (PNGINFL_WIN - 1)] = z->win[(z->wpos - z->mdist) & (PNGINFL_WIN - 1)];
+            continue;
+        }
+        /* used up the zeros past the end of the data */
+        if(z->cnt < z->pad * 8) return -1;
+        switch(z->type) {
+            case -2: return i;
+            case -1: if(!pnginfl_block(z)) { return -1; } break;
+            case 0:
+                if(!z->stored) { z->type = -1; break; }
+                /* bytes still in the bit buffer or in the next chunk go one by one, the rest is copied as is */
+                if(z->cnt || !z->left) {
+                    dst[i++] = z->win[z->wpos++ & (PNGINFL_WIN - 1)] = pnginfl_bits(z, 8);
+                    z->stored--;
+                    break;
+                }
+                s = n - i < z->stored ? n - i : z->stored;
+                if((uint32_t)s > z->left) s = z->left;
+                memcpy(dst + i, z->pos, s);
+                d = z->wpos & (PNGINFL_WIN - 1);
+                if(d + s > PNGINFL_WIN) {
+                    memcpy(z->win + d, z->pos, PNGINFL_WIN - d);
+                    memcpy(z->win, z->pos + PNGINFL_WIN - d, s - PNGINFL_WIN + d);
+                } else
+                    memcpy(z->win + d, z->pos, s);
+                z->pos += s; z->left -= s; z->wpos += s; z->stored -= s; i += s;
+            break;
+            default:
+                if(z->left >= 8) { if((i = pnginfl_fast(z, dst, i, n)) < 0) { return -1; } break; }
+                if((s = pnginfl_sym(z, &z->lit)) < 0 || s > 285) return -1;
+                if(s < 256) { dst[i++] = z->win[z->wpos++ & (PNGINFL_WIN - 1)] = s; break; }
+                if(s == 256) { z->type = -1; break; }
+                s -= 257;
+                z->mlen = pnginfl_lbase[s] + pnginfl_bits(z, pnginfl_lext[s]);
+                if((d = pnginfl_sym(z, &z->dist)) < 0 || d > 29) return -1;
+                z->mdist = pnginfl_dbase[d] + pnginfl_bits(z, pnginfl_dext[d]);
+                if((uint32_t)z->mdist > z->wpos) return -1;
+            break;
+        }
+    }
+    return i;
+}
+
+#endif /* PNG_INFL_H */
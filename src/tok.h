@@ -38,8 +38,20 @@ enum { TOK_COMMENT, TOK_PRECOMPILER, TOK_OPERATOR, TOK_NUMBER, TOK_STRING, TOK_S
     TOK_FUNCTION, TOK_VARIABLE };
 typedef struct {
     int num;        /* number of tokens */
-    char **tokens;  /* First character is a token type (see TOK_* enums), the rest is the string from the source code. */
+    char **tokens;  /* First character is a token type (see TOK_* enums), the rest is the string from the source code.
+                     * This is a gap buffer, so that edits are cheap, access the tokens with tok_get() */
+    void *arena;    /* the token strings are allocated from here, all freed at once by tok_free() */
+    int gap, cap;   /* where the gap is and the capacity of the tokens array (the gap is cap - num long) */
+    int *level;     /* bracket index, how each token changes the bracket levels, with the same gap as tokens (see
+                     * tok_next()). Edits through the API keep it up-to-date, if you modify token strings directly,
+                     * then do not add nor remove brackets */
 } tok_t;
+typedef struct {
+    int num;        /* number of tokens */
+    unsigned char *type;    /* token types (see TOK_* enums) */
+    int *off, *len; /* token positions in the source string, these are not copied */
+} tok_span_t;
+typedef struct tok_rules_s tok_rules_t;    /* opaque, precompiled language rules */
 
 /* language rules is a two dimensional string array, each a NULL terminated list of matching patterns (lowercase only),
  * where the top dimension encodes the token's type. For example:
@@ -54,15 +66,30 @@ typedef struct {
  *   char **c_rules[] =      { c_comments, c_precompiler, c_operators, c_numbers, c_strings, c_separators, c_types, c_keywords };
  *
  *   tok_new(&tok, c_rules, source_string, -1);
+ *
+ * If the same rules are used for many sources, then compile them once, and use tok_newc() instead:
+ *   tok_rules_t *c_compiled = tok_compile(c_rules);
+ *   tok_newc(&tok, c_compiled, source_string, -1);
+ *   tok_rules_free(c_compiled);
+ *
+ * If you don't need to modify the tokens, then tok_scan() returns them as spans into the source string, without copying.
  */
 
+#define tok_idx(t,i) ((i) < (t)->gap ? (i) : (i) + (t)->cap - (t)->num)   /* index of the i-th token in the tokens array */
+#define tok_get(t,i) ((t)->tokens[tok_idx(t,i)])                        /* get the i-th token (NULL at tok.num) */
 int  tok_new(tok_t *tok, char ***rules, char *src, int len);/* create new token list from string according to language rules */
+tok_rules_t *tok_compile(char ***rules);                    /* precompile language rules, returns NULL on bad pattern */
+int  tok_newc(tok_t *tok, tok_rules_t *rules, char *src, int len); /* same as tok_new() but with precompiled rules */
+int  tok_scan(tok_span_t *spans, tok_rules_t *rules, char *src, int len); /* get token types and positions only */
+void tok_span_free(tok_span_t *spans);                      /* free token spans */
+void tok_rules_free(tok_rules_t *rules);                    /* free precompiled rules */
 int  tok_tostr(tok_t *tok, char *dst, int maxlen);          /* convert token list to string */
 int  tok_strlen(tok_t *tok);                                /* returns how big buffer is required for tok_tostr() */
 int  tok_delete(tok_t *tok, int idx);                       /* remove a token */
 int  tok_insert(tok_t *tok, int idx, char type, char *str); /* insert a token before idx */
 int  tok_replace(tok_t *tok, int idx, char type, char *str);/* replace a token */
 int  tok_append(tok_t *tok, char type, char *str);          /* append a token at the end of the list */
+int  tok_splice(tok_t *tok, int idx, int ndel, char **src, int nins); /* replace a range of tokens in one go */
 int  tok_find(tok_t *tok, int idx, char type, char *str);   /* find next occurance of either type or str */
 int  tok_next(tok_t *tok, int idx, char type, char *str);   /* same as find but considers opening/closing parenthesis */
 int  tok_match(tok_t *tok, int idx, int num, ...);          /* match a token pattern */
@@ -117,24 +144,176 @@ void tok_dump(tok_t *tok, int sidx, int eidx);              /* for debugging */
 #define TOK_PAD 4
 #endif
 
+/* minimum size of an arena block, strings added after tokenization are allocated from blocks this big */
+#ifndef TOK_ARENA
+#define TOK_ARENA 4096
+#endif
+
 /*** Private API ***/
 
+/* arena block header, followed by the data */
+typedef struct _tok_arena_s {
+    struct _tok_arena_s *next;
+    int size, used;
+} _tok_arena_t;
+
 /**
- * Check if a string is listed in an array
+ * Allocate a zeroed token string from the arena
  */
-static int _tok_in_array(char *s, char **arr)
+static char *_tok_alloc(tok_t *tok, int size)
 {
+    _tok_arena_t *a = (_tok_arena_t*)tok->arena;
+    char *ret;
+
+    if(!a || a->used + size > a->size) {
+        a = (_tok_arena_t*)TOK_REALLOC(NULL, sizeof(_tok_arena_t) + (size > TOK_ARENA ? size : TOK_ARENA));
+        if(!a) return NULL;
+        a->next = (_tok_arena_t*)tok->arena;
+        a->size = size > TOK_ARENA ? size : TOK_ARENA;
+        a->used = 0;
+        tok->arena = a;
+    }
+    ret = (char*)(a + 1) + a->used;
+    a->used += size;
+    TOK_MEMSET(ret, 0, size);
+    return ret;
+}
+
+/**
+ * Move the gap in the tokens array before the given index, and make sure that it is at least need long
+ */
+static int _tok_gap(tok_t *tok, int idx, int need)
+{
+    char **t;
+    int l = tok->cap - tok->num, c, *v;
+
+    if(l < need) {
+        /* grow geometrically, and move the part after the gap to the new end */
+        c = 2 * tok->cap > tok->num + need + 256 ? 2 * tok->cap : tok->num + need + 256;
+        v = (int*)TOK_REALLOC(tok->level, (c + 1) * sizeof(int));
+        if(!v) return 0;
+        tok->level = v;
+        t = (char**)TOK_REALLOC(tok->tokens, (c + 1) * sizeof(char*));
+        if(!t) return 0;
+        TOK_MEMMOVE(t + tok->gap + c - tok->num, t + tok->gap + l, (tok->num - tok->gap) * sizeof(char*));
+        TOK_MEMMOVE(v + tok->gap + c - tok->num, v + tok->gap + l, (tok->num - tok->gap) * sizeof(int));
+        t[c] = NULL;
+        tok->tokens = t;
+        tok->cap = c;
+        l = c - tok->num;
+    }
+    if(idx < tok->gap) {
+        TOK_MEMMOVE(tok->tokens + idx + l, tok->tokens + idx, (tok->gap - idx) * sizeof(char*));
+        TOK_MEMMOVE(tok->level + idx + l, tok->level + idx, (tok->gap - idx) * sizeof(int));
+    } else if(idx > tok->gap) {
+        TOK_MEMMOVE(tok->tokens + tok->gap, tok->tokens + tok->gap + l, (idx - tok->gap) * sizeof(char*));
+        TOK_MEMMOVE(tok->level + tok->gap, tok->level + tok->gap + l, (idx - tok->gap) * sizeof(int));
+    }
+    tok->gap = idx;
+    return 1;
+}
+
+/**
+ * Get how a token changes the bracket levels of (), {} and [], packed into 10 bits each (string literals don't count)
+ */
+static int _tok_level(char *t)
+{
+    int p = 0, s = 0, b = 0;
+
+    if(!t || t[0] == TOK_STRING) return 0;
+    for(t++; *t; t++)
+        switch(*t) {
+            case '(': p++; break;
+            case ')': p--; break;
+            case '{': s++; break;
+            case '}': s--; break;
+            case '[': b++; break;
+            case ']': b--; break;
+        }
+    /* would not fit, this token has to be counted again by tok_next() */
+    if(p < -512 || p > 511 || s < -512 || s > 511 || b < -512 || b > 511) return 1 << 30;
+    return (p & 1023) | ((s & 1023) << 10) | ((b & 1023) << 20);
+}
+
+/**
+ * Allocate a token string from the arena and fill it in
+ */
+static char *_tok_str(tok_t *tok, char type, char *str, int l)
+{
+    char *dst = _tok_alloc(tok, l + TOK_PAD + 1);
+
+    if(dst) {
+        dst[0] = type;
+        TOK_MEMCPY(dst + 1, str, l);
+    }
+    return dst;
+}
+
+/* a keyword hash table entry */
+typedef struct {
+    char *str;                  /* the word as listed in the rules */
+    int len;
+    int type;                   /* TOK_TYPE or TOK_KEYWORD, 0 if the slot is free */
+} _tok_kw_t;
+
+/**
+ * Case insensitive hash of a word (FNV-1a)
+ */
+static unsigned int _tok_hash(char *s, int l)
+{
+    unsigned int h = 2166136261U;
+
+    for(; l > 0; l--, s++)
+        h = (h ^ (unsigned char)(*s >= 'A' && *s <= 'Z' ? *s + 'a' - 'A' : *s)) * 16777619U;
+    return h;
+}
+
+/* one element of a compiled pattern */
+typedef struct {
+    unsigned char valid[256];   /* matching characters */
+    int rmin, rmax;             /* repeat count, rmax 0 means unlimited */
+    char type;                  /* 0 character class, 1 skip until end of line, 2 skip until the rest of the pattern matches */
+    char more;                  /* set if the pattern string continues after this element */
+} _tok_atom_t;
+
+/* a compiled pattern */
+typedef struct {
+    _tok_atom_t *atoms;
+    int num;
+    unsigned char first[256];   /* characters a match can start with */
+} _tok_re_t;
+
+struct tok_rules_s {
+    char ***rules;              /* the original rules, string delimiters, types and keywords are looked up there */
+    _tok_re_t *re[4];           /* compiled patterns for comments, precompiler, operators and numbers */
+    int nre[4];
+    unsigned char sep[256];     /* separator characters */
+    _tok_kw_t *kw;              /* types and keywords in an open addressing hash table */
+    unsigned int kwmask;        /* hash table size - 1 */
+};
+
+/**
+ * Look up a word in the types and keywords (compared as lowercase, without copying it)
+ * Returns TOK_TYPE or TOK_KEYWORD if found, 0 otherwise.
+ */
+static int _tok_keyword(tok_rules_t *rules, char *s, int l)
+{
+    _tok_kw_t *kw;
+    unsigned int h;
     int i;
 
-    if(!s || !*s || !arr) return 0;
-    for(i = 0; arr[i]; i++)
-        if(!TOK_STRCMP(s, arr[i])) return 1;
+    if(!rules->kw || l < 1) return 0;
+    for(h = _tok_hash(s, l) & rules->kwmask; (kw = &rules->kw[h])->type; h = (h + 1) & rules->kwmask)
+        if(kw->len == l) {
+            for(i = 0; i < l && kw->str[i] == (s[i] >= 'A' && s[i] <= 'Z' ? s[i] + 'a' - 'A' : s[i]); i++);
+            if(i == l) return kw->type;
+        }
     return 0;
 }
 
 /**
- * A very minimalistic, non-UTF-8 aware regexp matcher. Enough to match language keywords.
- * Returns how many bytes matched, 0 if pattern doesn't match, -1 if pattern is bad.
+ * A very minimalistic, non-UTF-8 aware regexp compiler. Enough to match language keywords.
+ * Returns 1 on success, 0 if pattern is bad.
  * Supports:
  * $      - matches end of line
  * .*?    - skip bytes until the following pattern matches
@@ -154,20 +333,25 @@ static int _tok_in_array(char *s, char **arr)
  * {n,}   - at least n matches
  * {n,m}  - at least n, but no more than m matches
  */
-static int _tok_regexp(char *regexp, char *str)
+static int _tok_recomp(char *regexp, _tok_re_t *re)
 {
-    unsigned char valid[256], *c=(unsigned char*)regexp, *s=(unsigned char *)str;
-    int d, r, rmin, rmax, neg;
-    if(!regexp || !regexp[0] || !str || !str[0]) return -1;
+    unsigned char *valid, *c = (unsigned char*)regexp;
+    _tok_atom_t *a;
+    int d, neg;
+
+    TOK_MEMSET(re, 0, sizeof(_tok_re_t));
+    if(!regexp || !regexp[0]) return 0;
     while(*c) {
         if(*c == '(' || *c == ')') { c++; continue; }
-        rmin = rmax = r = 1; neg = 0;
-        TOK_MEMSET(valid, 0, sizeof(valid));
+        a = (_tok_atom_t*)TOK_REALLOC(re->atoms, (re->num + 1) * sizeof(_tok_atom_t));
+        if(!a) return 0;
+        re->atoms = a; a += re->num++;
+        TOK_MEMSET(a, 0, sizeof(_tok_atom_t));
+        a->rmin = a->rmax = 1; neg = 0; valid = a->valid;
         /* special case, non-greedy match */
         if(c[0] == '.' && c[1] == '*' && c[2] == '?') {
-            c += 3; if(!*c) return -1;
-            if(*c == '$') { c++; while(*s && *s != '\n') s++; }
-            else { while(*s && !_tok_regexp((char*)c, (char*)s)) s++; }
+            c += 3; if(!*c) return 0;
+            if(*c == '$') { c++; a->type = 1; } else a->type = 2;
         } else {
             /* get valid characters list */
             if(*c == '\\') { c++; valid[(unsigned int)*c] = 1; } else {
@@ -179,7 +363,7 @@ static int _tok_regexp(char *regexp, char *str)
                         else valid[(unsigned int)(*c == '$' ? 10 : *c)] = 1;
                         c++;
                     }
-                    if(!*c) return -1;
+                    if(!*c) return 0;
                     if(neg) { for(d = 0; d < 256; d++) valid[d] ^= 1; }
                 }
                 else if(*c == '.') { for(d = 0; d < 256; d++) valid[d] = 1; }
@@ -193,66 +377,189 @@ static int _tok_regexp(char *regexp, char *str)
             }
             /* get repeat count */
             if(*c == '{') {
-                c++; rmin = TOK_ATOI((char*)c); rmax = 0; while(*c && *c != ',' && *c != '}') c++;
-                if(*c == ',') { c++; if(*c != '}') { rmax = TOK_ATOI((char*)c); while(*c && *c != '}') c++; } }
-                if(*c != '}') return -1;
+                c++; a->rmin = TOK_ATOI((char*)c); a->rmax = 0; while(*c && *c != ',' && *c != '}') c++;
+                if(*c == ',') { c++; if(*c != '}') { a->rmax = TOK_ATOI((char*)c); while(*c && *c != '}') c++; } }
+                if(*c != '}') return 0;
                 c++;
             }
-            else if(*c == '?') { c++; rmin = 0; rmax = 1; }
-            else if(*c == '+') { c++; rmin = 1; rmax = 0; }
-            else if(*c == '*') { c++; rmin = 0; rmax = 0; }
+            else if(*c == '?') { c++; a->rmin = 0; a->rmax = 1; }
+            else if(*c == '+') { c++; a->rmin = 1; a->rmax = 0; }
+            else if(*c == '*') { c++; a->rmin = 0; a->rmax = 0; }
+        }
+        a->more = *c != 0;
+    }
+    /* if the first element must match at least once, then only its characters can start a match */
+    if(re->num > 0 && !re->atoms[0].type && re->atoms[0].rmin > 0)
+        TOK_MEMCPY(re->first, re->atoms[0].valid, 256);
+    else
+        TOK_MEMSET(re->first, 1, 256);
+    return 1;
+}
+
+/**
+ * Match a compiled pattern.
+ * Returns how many bytes matched, 0 if pattern doesn't match.
+ */
+static int _tok_rematch(_tok_atom_t *a, int n, unsigned char *str)
+{
+    unsigned char *s = str;
+    int r;
+
+    for(; n > 0; n--, a++) {
+        r = 1;
+        if(a->type == 1) { while(*s && *s != '\n') s++; } else
+        if(a->type == 2) { while(*s && !_tok_rematch(a + 1, n - 1, s)) s++; }
+        else {
             /* do the match */
-            for(r = 0; *s && valid[(unsigned int)*s] && (!rmax || r < rmax); s++, r++);
+            for(r = 0; *s && a->valid[*s] && (!a->rmax || r < a->rmax); s++, r++);
             /* allow exactly one + or - inside floating point numbers if they come right after the exponent marker */
             if(r && ((str[0] >= '0' && str[0] <= '9') || (str[0] == '-' && str[1] >= '0' && str[1] <= '9')) &&
                 (*s == '+' || *s == '-') && (s[-1] == 'e' || s[-1] == 'E' || s[-1] == 'p' || s[-1] == 'P'))
-                    for(s++; *s && valid[(unsigned int)*s] && (!rmax || r < rmax); s++, r++);
+                    for(s++; *s && a->valid[*s] && (!a->rmax || r < a->rmax); s++, r++);
         }
-        if((!*s && *c) || r < rmin) return 0;
+        if((!*s && a->more) || r < a->rmin) return 0;
     }
     return (int)((intptr_t)s - (intptr_t)str);
 }
 
 /*** Public API ***/
 
+/**
+ * Precompile language rules
+ * @param rules: language rules
+ * @return compiled rules, or NULL on failure
+ */
+tok_rules_t *tok_compile(char ***rules)
+{
+    tok_rules_t *ret;
+    int i, k, l, m;
+    unsigned int h;
+
+    if(!rules) return NULL;
+    ret = (tok_rules_t*)TOK_REALLOC(NULL, sizeof(tok_rules_t));
+    if(!ret) return NULL;
+    TOK_MEMSET(ret, 0, sizeof(tok_rules_t));
+    ret->rules = rules;
+    for(m = 0; m < 4; m++)
+        if(rules[m]) {
+            for(i = 0; rules[m][i]; i++);
+            if(!i) continue;
+            ret->re[m] = (_tok_re_t*)TOK_REALLOC(NULL, i * sizeof(_tok_re_t));
+            if(!ret->re[m]) { tok_rules_free(ret); return NULL; }
+            TOK_MEMSET(ret->re[m], 0, i * sizeof(_tok_re_t));
+            for(ret->nre[m] = 0; ret->nre[m] < i; ret->nre[m]++)
+                if(!_tok_recomp(rules[m][ret->nre[m]], &ret->re[m][ret->nre[m]])) {
+                    ret->nre[m]++; tok_rules_free(ret); return NULL;
+                }
+        }
+    if(rules[5])
+        for(i = 0; rules[5][i]; i++)
+            ret->sep[(unsigned char)rules[5][i][0]] = 1;
+    /* hash types and keywords, with at least twice as many slots as words to keep the probe chains short */
+    for(i = m = 0; m < 2; m++)
+        if(rules[6 + m])
+            for(k = 0; rules[6 + m][k]; k++, i++);
+    for(ret->kwmask = 15; ret->kwmask < 2U * i; ret->kwmask = ret->kwmask * 2 + 1);
+    ret->kw = (_tok_kw_t*)TOK_REALLOC(NULL, (ret->kwmask + 1) * sizeof(_tok_kw_t));
+    if(!ret->kw) { tok_rules_free(ret); return NULL; }
+    TOK_MEMSET(ret->kw, 0, (ret->kwmask + 1) * sizeof(_tok_kw_t));
+    for(m = 6; m < 8; m++)
+        if(rules[m])
+            for(k = 0; rules[m][k]; k++) {
+                l = TOK_STRLEN(rules[m][k]);
+                if(!l) continue;
+                /* if a word is listed in both, types take precedence */
+                for(h = _tok_hash(rules[m][k], l) & ret->kwmask; ret->kw[h].type &&
+                  (ret->kw[h].len != l || TOK_MEMCMP(ret->kw[h].str, rules[m][k], l)); h = (h + 1) & ret->kwmask);
+                if(ret->kw[h].type) continue;
+                ret->kw[h].str = rules[m][k];
+                ret->kw[h].len = l;
+                ret->kw[h].type = m;
+            }
+    return ret;
+}
+
+/**
+ * Free precompiled language rules
+ * @param rules: compiled rules
+ */
+void tok_rules_free(tok_rules_t *rules)
+{
+    int i, m;
+
+    if(!rules) return;
+    for(m = 0; m < 4; m++)
+        if(rules->re[m]) {
+            for(i = 0; i < rules->nre[m]; i++)
+                if(rules->re[m][i].atoms) TOK_FREE(rules->re[m][i].atoms);
+            TOK_FREE(rules->re[m]);
+        }
+    if(rules->kw) TOK_FREE(rules->kw);
+    TOK_FREE(rules);
+}
+
 /**
  * Source code tokenizer.
  * @param tok: tok instance
+ * @param rules: language rules
  * @param src: zero terminated UTF-8 string
  * @param maxlen: length of the string or -1
  * @return 1 on success, 0 on failure
  */
 int tok_new(tok_t *tok, char ***rules, char *src, int len)
 {
-    char *s, *d, ***r = rules;
+    tok_rules_t *compiled;
+    int ret;
+
+    if(!(compiled = tok_compile(rules))) return 0;
+    ret = tok_newc(tok, compiled, src, len);
+    tok_rules_free(compiled);
+    return ret;
+}
+
+/**
+ * Source code tokenizer, returns token spans only.
+ * @param spans: token spans, types, positions and lengths in parallel arrays
+ * @param rules: compiled language rules (see tok_compile())
+ * @param src: zero terminated UTF-8 string
+ * @param maxlen: length of the string or -1
+ * @return 1 on success, 0 on failure
+ */
+int tok_scan(tok_span_t *spans, tok_rules_t *rules, char *src, int len)
+{
+    char *s, ***r;
+    _tok_re_t *re;
     int i, j, k, l, m, at = 0, nt = 0, *t = NULL;
 
     if(len == -1 && src) len = TOK_STRLEN(src);
-    if(tok && rules && src && *src && len > 0) {
-        TOK_MEMSET(tok, 0, sizeof(tok_t));
+    if(!spans) return 0;
+    TOK_MEMSET(spans, 0, sizeof(tok_span_t));
+    if(rules && src && *src && len > 0) {
+        r = rules->rules;
         /* tokenize string */
         for(k = 0; src[k] && k < len; ) {
             if(nt + 2 >= at) {
-                t = (int*)TOK_REALLOC(t, (at + 256) * sizeof(int));
-                if(!t) return 0;
+                s = (char*)TOK_REALLOC(t, (at + 256) * sizeof(int));
+                if(!s) { TOK_FREE(t); return 0; }
+                t = (int*)s;
                 TOK_MEMSET(t + at, 0, 256 * sizeof(int));
                 at += 256;
             }
             if(src[k] == '(') { t[nt++] = (k << 4) | 5; k++; continue; }
-            j = 0; if(r[5]) for(i = 0; r[5][i]; i++) if(r[5][i][0] == src[k]) { j = 1; break; }
-            if(src[k] == ')' || src[k] == ' ' || src[k] == '\t' || src[k] == '\r' || src[k] == '\n' || j) {
+            if(src[k] == ')' || src[k] == ' ' || src[k] == '\t' || src[k] == '\r' || src[k] == '\n' ||
+              rules->sep[(unsigned char)src[k]]) {
                 if(!nt || (t[nt - 1] & 0xf) != 5 || src[k] == ',' || src[k] == ')') t[nt++] = (k << 4) | 5;
                 k++; continue;
             }
             for(m = 0; m < 4; m++)
-                if(r[m])
-                    for(i = 0; r[m][i]; i++) {
-                        l = _tok_regexp(r[m][i], src + k);
-                        if(l > 0) {
-                            if(!nt || (t[nt - 1] & 0xf) != m) t[nt++] = (k << 4) | m;
-                            k += l - 1; goto nextchar;
-                        }
+                for(i = 0, re = rules->re[m]; i < rules->nre[m]; i++, re++) {
+                    if(!re->first[(unsigned char)src[k]]) continue;
+                    l = _tok_rematch(re->atoms, re->num, (unsigned char*)src + k);
+                    if(l > 0) {
+                        if(!nt || (t[nt - 1] & 0xf) != m) t[nt++] = (k << 4) | m;
+                        k += l - 1; goto nextchar;
                     }
+                }
             if(r[4])
                 for(i = 0; r[4][i]; i++) {
                     l = TOK_STRLEN(r[4][i]);
@@ -273,43 +580,82 @@ nextchar:   if(src[k]) k++;
                 if((t[i] & 0xf) == 9) {
                     j = i + 1 < nt ? t[i + 1] >> 4 : k;
                     l = t[i] >> 4;
-                    s = d = (char*)TOK_REALLOC(NULL, j - l + 1);
-                    if(!s) return 0;
-                    for(; l < j; l++)
-                        *d++ = src[l] >= 'A' && src[l] <= 'Z' ? src[l] + 'a' - 'A' : src[l];
-                    *d = 0;
-                    if(_tok_in_array(s, r[6])) t[i] = (t[i] & ~0xf) | 6; else
-                    if(_tok_in_array(s, r[7])) t[i] = (t[i] & ~0xf) | 7; else
-                    if(src[l] == '(' || (i + 2 < nt && (t[i + 2] & 0xf) == 5 && src[t[i + 2] >> 4] == '('))
+                    if((m = _tok_keyword(rules, src + l, j - l))) t[i] = (t[i] & ~0xf) | m; else
+                    if(src[j] == '(' || (i + 2 < nt && (t[i + 2] & 0xf) == 5 && src[t[i + 2] >> 4] == '('))
                         t[i] = (t[i] & ~0xf) | 8;
-                    TOK_FREE(s);
                 }
                 if(i && (t[i] & 0xf) == 3 && (t[i - 1] & 0xf) == 2 && (src[t[i - 1] >> 4] == '-' || src[t[i - 1] >> 4] == '.') &&
                   src[(t[i - 1] >> 4) + 1] != '=')
                     t[i] -= 16;
             }
-            tok->tokens = (char**)TOK_REALLOC(NULL, (nt + 1) * sizeof(char*));
-            if(!tok->tokens) return 0;
-            TOK_MEMSET(tok->tokens, 0, (nt + 1) * sizeof(char*));
+            /* one allocation for all the parallel arrays */
+            s = (char*)TOK_REALLOC(NULL, nt * (2 * sizeof(int) + 1));
+            if(!s) { TOK_FREE(t); return 0; }
+            spans->off = (int*)s;
+            spans->len = spans->off + nt;
+            spans->type = (unsigned char*)(spans->len + nt);
             for(i = l = m = 0; i < nt; i++) {
                 j = i + 1 < nt ? t[i + 1] >> 4 : k;
                 if(j <= l) continue;
-                tok->tokens[m] = (char*)TOK_REALLOC(NULL, j - l + TOK_PAD + 1);
-                if(tok->tokens[m]) {
-                    TOK_MEMSET(tok->tokens[m], 0, j - l + TOK_PAD + 1);
-                    tok->tokens[m][0] = t[i] & 0xF;
-                    TOK_MEMCPY(tok->tokens[m] + 1, src + l, j - l);
-                    m++;
-                }
+                spans->type[m] = t[i] & 0xF;
+                spans->off[m] = l;
+                spans->len[m] = j - l;
+                m++;
                 l = j;
             }
-            tok->num = m;
+            spans->num = m;
+            TOK_FREE(t);
             return 1;
         }
     }
     return 0;
 }
 
+/**
+ * Free token spans
+ * @param spans: token spans
+ */
+void tok_span_free(tok_span_t *spans)
+{
+    if(spans && spans->off) TOK_FREE(spans->off);
+    if(spans) TOK_MEMSET(spans, 0, sizeof(tok_span_t));
+}
+
+/**
+ * Source code tokenizer with precompiled rules.
+ * @param tok: tok instance
+ * @param rules: compiled language rules (see tok_compile())
+ * @param src: zero terminated UTF-8 string
+ * @param maxlen: length of the string or -1
+ * @return 1 on success, 0 on failure
+ */
+int tok_newc(tok_t *tok, tok_rules_t *rules, char *src, int len)
+{
+    tok_span_t spans;
+    char *d;
+    int i, l;
+
+    if(!tok || !tok_scan(&spans, rules, src, len)) return 0;
+    TOK_MEMSET(tok, 0, sizeof(tok_t));
+    /* the token strings are copied into one arena block */
+    for(i = l = 0; i < spans.num; i++)
+        l += spans.len[i] + TOK_PAD + 1;
+    tok->tokens = (char**)TOK_REALLOC(NULL, (spans.num + 1) * sizeof(char*));
+    tok->level = (int*)TOK_REALLOC(NULL, (spans.num + 1) * sizeof(int));
+    if(!tok->tokens || !tok->level || !(d = _tok_alloc(tok, l))) { tok_span_free(&spans); tok_free(tok); return 0; }
+    TOK_MEMSET(tok->tokens, 0, (spans.num + 1) * sizeof(char*));
+    for(i = 0; i < spans.num; i++) {
+        tok->tokens[i] = d;
+        d[0] = spans.type[i];
+        TOK_MEMCPY(d + 1, src + spans.off[i], spans.len[i]);
+        tok->level[i] = _tok_level(d);
+        d += spans.len[i] + TOK_PAD + 1;
+    }
+    tok->num = tok->gap = tok->cap = spans.num;
+    tok_span_free(&spans);
+    return 1;
+}
+
 /**
  * Detokenizer, constructs string from list of tokens
  * @param tok: tok instance
@@ -324,10 +670,10 @@ int tok_tostr(tok_t *tok, char *dst, int maxlen)
 
     if(tok && tok->num > 0 && tok->tokens && dst && maxlen > 0)
         for(i = 0; i < tok->num; i++) {
-            if(tok->tokens[i]) {
-                l = TOK_STRLEN(tok->tokens[i] + 1);
+            if(tok_get(tok, i)) {
+                l = TOK_STRLEN(tok_get(tok, i) + 1);
                 if(d + l < end) {
-                    TOK_MEMCPY(d, tok->tokens[i] + 1, l);
+                    TOK_MEMCPY(d, tok_get(tok, i) + 1, l);
                     d += l;
                 } else
                     return -1;
@@ -347,8 +693,8 @@ int tok_strlen(tok_t *tok)
 
     if(tok && tok->num > 0 && tok->tokens)
         for(i = 0, l++; i < tok->num; i++)
-            if(tok->tokens[i])
-                l += TOK_STRLEN(tok->tokens[i] + 1);
+            if(tok_get(tok, i))
+                l += TOK_STRLEN(tok_get(tok, i) + 1);
     return l;
 }
 
@@ -361,12 +707,7 @@ int tok_strlen(tok_t *tok)
 int tok_delete(tok_t *tok, int idx)
 {
     if(!tok || !tok->tokens || idx < 0 || idx >= tok->num) return 0;
-    if(tok->tokens[idx]) TOK_FREE(tok->tokens[idx]);
-    TOK_MEMCPY(&tok->tokens[idx], &tok->tokens[idx + 1], (tok->num - idx) * sizeof(char*));
-    tok->num--;
-    tok->tokens = (char**)TOK_REALLOC(tok->tokens, tok->num * sizeof(char*));
-    if(!tok->tokens) { tok->num = 0; return 0; }
-    return 1;
+    return tok_splice(tok, idx, 1, NULL, 0);
 }
 
 /**
@@ -382,18 +723,14 @@ int tok_insert(tok_t *tok, int idx, char type, char *str)
     int l;
     char *dst;
 
-    if(idx == -1 || idx == tok->num) return tok_append(tok, type, str);
-    if(!tok || !tok->tokens || idx < 0 || idx > tok->num || type < 0 || type > 9 || !str || !*str) return 0;
+    if(!tok || !tok->tokens) return 0;
+    if(idx == -1) idx = tok->num;
+    if(idx < 0 || idx > tok->num || type < 0 || type > 9 || !str || !*str) return 0;
     l = TOK_STRLEN(str);
-    tok->tokens = (char**)TOK_REALLOC(tok->tokens, (tok->num + 1) * sizeof(char*));
-    if(!tok->tokens) { tok->num = 0; return 0; }
-    dst = (char*)TOK_REALLOC(NULL, l + TOK_PAD + 1);
-    if(!dst) return 0;
-    TOK_MEMSET(dst, 0, l + TOK_PAD + 1);
-    TOK_MEMCPY(dst + 1, str, l);
-    dst[0] = type;
-    TOK_MEMMOVE(&tok->tokens[idx + 1], &tok->tokens[idx], (tok->num - idx) * sizeof(char*));
-    tok->tokens[idx] = dst;
+    dst = _tok_str(tok, type, str, l);
+    if(!dst || !_tok_gap(tok, idx, 1)) return 0;
+    tok->level[tok->gap] = _tok_level(dst);
+    tok->tokens[tok->gap++] = dst;
     tok->num++;
     return 1;
 }
@@ -413,13 +750,51 @@ int tok_replace(tok_t *tok, int idx, char type, char *str)
 
     if(!tok || !tok->tokens || idx < 0 || idx >= tok->num || type < 0 || type > 9 || !str || !*str) return 0;
     l = TOK_STRLEN(str);
-    dst = (char*)TOK_REALLOC(NULL, l + TOK_PAD + 1);
+    dst = _tok_str(tok, type, str, l);
     if(!dst) return 0;
-    TOK_MEMSET(dst, 0, l + TOK_PAD + 1);
-    TOK_MEMCPY(dst + 1, str, l);
-    dst[0] = type;
-    if(tok->tokens[idx]) TOK_FREE(tok->tokens[idx]);
-    tok->tokens[idx] = dst;
+    tok->level[tok_idx(tok, idx)] = _tok_level(dst);
+    tok_get(tok, idx) = dst;
+    return 1;
+}
+
+/**
+ * Delete and insert multiple tokens at once
+ * @param tok: tok instance
+ * @param idx: where
+ * @param ndel: number of tokens to remove from idx
+ * @param src: tokens to insert at idx, same format as tok.tokens (first character is the type), might be from this list
+ * @param nins: number of tokens in src
+ * @return 1 on success, 0 on failure
+ */
+int tok_splice(tok_t *tok, int idx, int ndel, char **src, int nins)
+{
+    int i, l, n;
+    char *dst = NULL;
+
+    if(!tok || !tok->tokens || idx < 0 || ndel < 0 || nins < 0 || idx + ndel > tok->num || (nins && !src)) return 0;
+    for(i = l = 0; i < nins; i++) {
+        if(!src[i] || src[i][0] < 0 || src[i][0] > 9 || !src[i][1]) return 0;
+        /* the type byte can be TOK_COMMENT, which is zero, so measure from the string */
+        l += 1 + TOK_STRLEN(src[i] + 1) + TOK_PAD;
+    }
+    /* copy the new strings into one arena block first, before anything is removed */
+    if(nins) {
+        if(!(dst = _tok_alloc(tok, l))) return 0;
+        for(i = l = 0; i < nins; i++) {
+            n = 1 + TOK_STRLEN(src[i] + 1);
+            TOK_MEMCPY(dst + l, src[i], n);
+            l += n + TOK_PAD;
+        }
+    }
+    /* the removed tokens after the gap are simply added to it, then the new ones are taken from its beginning */
+    if(!_tok_gap(tok, idx, nins - ndel)) return 0;
+    tok->num -= ndel;
+    for(i = 0; i < nins; i++, dst += l + TOK_PAD) {
+        l = 1 + TOK_STRLEN(dst + 1);
+        tok->level[tok->gap] = _tok_level(dst);
+        tok->tokens[tok->gap++] = dst;
+    }
+    tok->num += nins;
     return 1;
 }
 
@@ -432,20 +807,7 @@ int tok_replace(tok_t *tok, int idx, char type, char *str)
  */
 int tok_append(tok_t *tok, char type, char *str)
 {
-    int l;
-    char *dst;
-
-    if(!tok || !tok->tokens || type < 0 || type > 9 || !str || !*str) return 0;
-    tok->tokens = (char**)TOK_REALLOC(tok->tokens, (tok->num + 1) * sizeof(char*));
-    if(!tok->tokens) { tok->num = 0; return 0; }
-    l = TOK_STRLEN(str);
-    dst = (char*)TOK_REALLOC(NULL, l + TOK_PAD + 1);
-    if(!dst) return 0;
-    TOK_MEMSET(dst, 0, l + TOK_PAD + 1);
-    TOK_MEMCPY(dst + 1, str, l);
-    dst[0] = type;
-    tok->tokens[tok->num++] = dst;
-    return 1;
+    return tok_insert(tok, -1, type, str);
 }
 
 /**
@@ -462,7 +824,7 @@ int tok_find(tok_t *tok, int idx, char type, char *str)
 
     if(!tok || !tok->tokens || idx < 0 || idx >= tok->num || type < -1 || type > 9) return -1;
     for(i = idx; i < tok->num; i++)
-        if(tok->tokens[i] && ((type == -1 || tok->tokens[i][0] == type) && (str == NULL || !TOK_STRCMP(tok->tokens[i] + 1, str))))
+        if(tok_get(tok, i) && ((type == -1 || tok_get(tok, i)[0] == type) && (str == NULL || !TOK_STRCMP(tok_get(tok, i) + 1, str))))
             return i;
     return -1;
 }
@@ -477,26 +839,32 @@ int tok_find(tok_t *tok, int idx, char type, char *str)
  */
 int tok_next(tok_t *tok, int idx, char type, char *str)
 {
-    int i, j, p = 0, s = 0, b = 0;
+    int i, j, l, p = 0, s = 0, b = 0;
+    char *t;
 
-    if(!tok || !tok->tokens || idx < 0 || idx >= tok->num || type < -1 || type > 9) return -1;
-    for(i = idx; i < tok->num; i++)
-        if(tok->tokens[i]) {
-            if(!p && !s && !b && ((type == -1 || tok->tokens[i][0] == type) && (str == NULL || !TOK_STRCMP(tok->tokens[i] + 1, str))))
-                return i;
-            /* skip string literals */
-            if(tok->tokens[i][0] != 4) {
-                for(j = 1; tok->tokens[i][j]; j++) {
-                    if(tok->tokens[i][j] == '(') p++;
-                    if(tok->tokens[i][j] == ')') p--;
-                    if(tok->tokens[i][j] == '{') s++;
-                    if(tok->tokens[i][j] == '}') s--;
-                    if(tok->tokens[i][j] == '[') b++;
-                    if(tok->tokens[i][j] == ']') b--;
+    if(!tok || !tok->tokens || !tok->level || idx < 0 || idx >= tok->num || type < -1 || type > 9) return -1;
+    for(i = idx; i < tok->num; i++) {
+        if(!p && !s && !b && (t = tok_get(tok, i)) && ((type == -1 || t[0] == type) && (str == NULL || !TOK_STRCMP(t + 1, str))))
+            return i;
+        /* use the bracket index instead of looking at the string, most tokens have no brackets at all */
+        if((l = tok->level[tok_idx(tok, i)])) {
+            if(l & (1 << 30)) {
+                for(j = 1, t = tok_get(tok, i); t[j]; j++) {
+                    if(t[j] == '(') p++;
+                    if(t[j] == ')') p--;
+                    if(t[j] == '{') s++;
+                    if(t[j] == '}') s--;
+                    if(t[j] == '[') b++;
+                    if(t[j] == ']') b--;
                 }
-                if(p < 0 || s < 0 || b < 0) return -1;
+            } else {
+                p += ((l & 1023) ^ 512) - 512;
+                s += (((l >> 10) & 1023) ^ 512) - 512;
+                b += (((l >> 20) & 1023) ^ 512) - 512;
             }
+            if(p < 0 || s < 0 || b < 0) return -1;
         }
+    }
     return -1;
 }
 
@@ -516,7 +884,7 @@ int tok_match(tok_t *tok, int idx, int num, ...)
 
     if(!tok || !tok->tokens || idx < 0 || num < 1 || idx + num >= tok->num) { TOK_VA_END(args); return 0; }
     for(i = idx; i < idx + num; i++)
-        if(!tok->tokens[i] || (int)tok->tokens[i][0] != TOK_VA_ARG(args, int)) { TOK_VA_END(args); return 0; }
+        if(!tok_get(tok, i) || (int)tok_get(tok, i)[0] != TOK_VA_ARG(args, int)) { TOK_VA_END(args); return 0; }
     TOK_VA_END(args);
     return 1;
 }
@@ -527,11 +895,15 @@ int tok_match(tok_t *tok, int idx, int num, ...)
  */
 void tok_free(tok_t *tok)
 {
-    int i;
+    _tok_arena_t *a, *n;
 
-    if(tok && tok->num > 0 && tok->tokens)
-        for(i = 0; i < tok->num; i++)
-            if(tok->tokens[i]) TOK_FREE(tok->tokens[i]);
+    if(!tok) return;
+    for(a = (_tok_arena_t*)tok->arena; a; a = n) {
+        n = a->next;
+        TOK_FREE(a);
+    }
+    if(tok->tokens) TOK_FREE(tok->tokens);
+    if(tok->level) TOK_FREE(tok->level);
     TOK_MEMSET(tok, 0, sizeof(tok_t));
 }
 
@@ -553,9 +925,9 @@ void tok_dump(tok_t *tok, int sidx, int eidx)
         if(eidx < 1 || eidx > tok->num) eidx = tok->num;
         if(tok->num > 0 && tok->tokens)
             for(i = sidx; i < eidx; i++)
-                printf("tok.tokens[%04u] %x %s '%s'\r\n", i, tok->tokens[i] ? tok->tokens[i][0] : 0xff,
-                    types[(int)(tok->tokens[i] && tok->tokens[i][0] >= 0 && tok->tokens[i][0] < 10 ? tok->tokens[i][0] : 10)],
-                    tok->tokens[i] ? tok->tokens[i] + 1 : "(NULL)");
+                printf("tok.tokens[%04u] %x %s '%s'\r\n", i, tok_get(tok, i) ? tok_get(tok, i)[0] : 0xff,
+                    types[(int)(tok_get(tok, i) && tok_get(tok, i)[0] >= 0 && tok_get(tok, i)[0] < 10 ? tok_get(tok, i)[0] : 10)],
+                    tok_get(tok, i) ? tok_get(tok, i) + 1 : "(NULL)");
     }
 }
 #endif